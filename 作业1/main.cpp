@@ -1,11 +1,21 @@
 #include "Triangle.hpp"
 #include "rasterizer.hpp"
 #include <Eigen/Eigen>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
 #include <opencv2/opencv.hpp>
 
 constexpr double MY_PI = 3.1415926;
 
+// Most frames a single sweep line may ask for
+constexpr int max_sweep_frames = 100000;
+
 Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
 {
     Eigen::Matrix4f view = Eigen::Matrix4f::Identity();
@@ -77,6 +87,208 @@ Eigen::Matrix4f get_rotation(Vector3f axis, float angle) {
     return model;
 }
 
+// One image of a batch job: the model turned by angle degrees about z, seen from eye
+struct frame_job
+{
+    std::string output;
+    float angle = 0;
+    Eigen::Vector3f eye = {0, 0, 5};
+    float fov = 45, z_near = 0.1f, z_far = 50;
+};
+
+// The run of '#' in pattern replaced by number, padded with zeros to the run's length
+std::string frame_name(const std::string& pattern, int number)
+{
+    size_t first = pattern.find('#');
+    size_t last = pattern.find_first_not_of('#', first);
+    last = last == std::string::npos ? pattern.size() : last;
+    std::string digits = std::to_string(number);
+    if (digits.size() < last - first)
+    {
+        digits.insert(0, last - first - digits.size(), '0');
+    }
+    return pattern.substr(0, first) + digits + pattern.substr(last);
+}
+
+/*
+ * Reads a job file; every line that is not empty or a # comment adds frames:
+ *
+ *   <output> <angle> [<eye x> <eye y> <eye z> [<fov> <near> <far>]]
+ *   sweep <first angle> <last angle> <step> <output pattern> [<eye x> <eye y> <eye z> [<fov> <near> <far>]]
+ *
+ * A sweep renders first, first + step, ... up to last angle, naming frame i by the pattern with its
+ * run of '#' replaced by i; sweeps of more than max_sweep_frames frames are rejected.
+ * */
+std::vector<frame_job> read_jobs(std::istream& in)
+{
+    std::vector<frame_job> jobs;
+    std::string line;
+    for (int number = 1; std::getline(in, line); ++number)
+    {
+        std::istringstream words(line);
+        std::string first;
+        if (!(words >> first) || first[0] == '#')
+        {
+            continue;
+        }
+
+        frame_job job;
+        float from = 0, to = 0, step = 0;
+        bool sweep = first == "sweep";
+        bool ok = sweep ? bool(words >> from >> to >> step >> job.output) : bool(words >> job.angle);
+        if (!sweep)
+        {
+            job.output = first;
+        }
+        // Then nothing, the eye, or the eye and the projection
+        std::vector<float> camera;
+        for (float v; words >> v;)
+        {
+            camera.push_back(v);
+        }
+        ok = ok && words.eof() && (camera.empty() || camera.size() == 3 || camera.size() == 6);
+        if (camera.size() >= 3)
+        {
+            job.eye = {camera[0], camera[1], camera[2]};
+        }
+        if (camera.size() == 6)
+        {
+            job.fov = camera[3];
+            job.z_near = camera[4];
+            job.z_far = camera[5];
+        }
+        if (!ok || (sweep && (step <= 0 || job.output.find('#') == std::string::npos)))
+        {
+            throw std::runtime_error("Job line " + std::to_string(number) + " is malformed: " + line);
+        }
+
+        if (!sweep)
+        {
+            jobs.push_back(job);
+            continue;
+        }
+        // Also false for a NaN or infinite range
+        if (!((double(to) - from) / step < max_sweep_frames))
+        {
+            throw std::runtime_error("Job line " + std::to_string(number) + " sweeps more than " +
+                                     std::to_string(max_sweep_frames) + " frames: " + line);
+        }
+        std::string pattern = job.output;
+        for (int i = 0; i < max_sweep_frames && from + i * step <= to; ++i)
+        {
+            job.angle = from + i * step;
+            job.output = frame_name(pattern, i);
+            jobs.push_back(job);
+        }
+    }
+    return jobs;
+}
+
+// Encodes and writes images on a thread of its own, so the next frame renders while this one is written.
+// At most max_pending images wait; write blocks while that many do.
+class image_writer
+{
+public:
+    explicit image_writer(size_t max_pending) : max_pending(max_pending), worker(&image_writer::run, this) {}
+
+    ~image_writer() { finish(); }
+
+    void write(const std::string& filename, cv::Mat image)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return pending.size() < max_pending; });
+        pending.push_back({filename, std::move(image)});
+        changed.notify_all();
+    }
+
+    // Waits until everything is written and returns the names of the images that could not be
+    std::vector<std::string> finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+            changed.notify_all();
+        }
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+        return failed;
+    }
+
+private:
+    struct image
+    {
+        std::string filename;
+        cv::Mat pixels;
+    };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            changed.wait(lock, [this] { return done || !pending.empty(); });
+            if (pending.empty())
+            {
+                return;
+            }
+            image next = std::move(pending.front());
+            pending.pop_front();
+            changed.notify_all();
+
+            lock.unlock();
+            bool written = false;
+            try
+            {
+                written = cv::imwrite(next.filename, next.pixels);
+            }
+            catch (const cv::Exception&)
+            {
+            }
+            lock.lock();
+            if (!written)
+            {
+                failed.push_back(next.filename);
+            }
+        }
+    }
+
+    size_t max_pending;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<image> pending;
+    std::vector<std::string> failed;
+    bool done = false;
+    std::thread worker;
+};
+
+// Renders every job with one rasterizer and one set of buffers; returns the process exit code
+int run_batch(const std::vector<frame_job>& jobs, rst::rasterizer& r, rst::pos_buf_id pos_id, rst::ind_buf_id ind_id)
+{
+    image_writer writer(4);
+    for (const frame_job& job : jobs)
+    {
+        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+
+        r.set_model(get_model_matrix(job.angle));
+        r.set_view(get_view_matrix(job.eye));
+        r.set_projection(get_projection_matrix(job.fov, 1, job.z_near, job.z_far));
+
+        r.draw(pos_id, ind_id, rst::Primitive::Triangle);
+        cv::Mat image;
+        cv::Mat(700, 700, CV_32FC3, r.frame_buffer().data()).convertTo(image, CV_8UC3, 1.0f);
+        writer.write(job.output, std::move(image));
+    }
+
+    std::vector<std::string> failed = writer.finish();
+    for (const std::string& name : failed)
+    {
+        std::cerr << "Cannot write " << name << '\n';
+    }
+    std::cout << jobs.size() - failed.size() << " of " << jobs.size() << " frames written\n";
+    return failed.empty() ? 0 : 1;
+}
 
 int main(int argc, const char** argv)
 {
@@ -84,14 +296,42 @@ int main(int argc, const char** argv)
     bool command_line = false;
     std::string filename = "output.png";
 
-    if (argc >= 3) {
-        command_line = true;
-        angle = std::stof(argv[2]); // -r by default
-        if (argc == 4) {
-            filename = std::string(argv[3]);
+    /*
+     * main -r <angle> [<output>]          one image, output.png if no name is given
+     * main --batch <job file>             the frames of a job file (see read_jobs), - for standard input
+     * main --sweep <first> <last> <step> <output pattern>
+     *                                     the model turned from first to last angle
+     * */
+    std::vector<frame_job> jobs;
+    bool batch = false;
+    try {
+        if (argc == 3 && std::string(argv[1]) == "--batch") {
+            batch = true;
+            std::ifstream file;
+            if (std::string(argv[2]) != "-") {
+                file.open(argv[2]);
+                if (!file) {
+                    throw std::runtime_error(std::string("Cannot read job file ") + argv[2]);
+                }
+            }
+            jobs = read_jobs(file.is_open() ? file : std::cin);
+        }
+        else if (argc == 6 && std::string(argv[1]) == "--sweep") {
+            batch = true;
+            std::istringstream line(std::string("sweep ") + argv[2] + ' ' + argv[3] + ' ' + argv[4] + ' ' + argv[5]);
+            jobs = read_jobs(line);
+        }
+        else if (argc >= 3) {
+            command_line = true;
+            angle = std::stof(argv[2]); // -r by default
+            if (argc == 4) {
+                filename = std::string(argv[3]);
+            }
         }
-        else
-            return 0;
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
     }
 
     rst::rasterizer r(700, 700);
@@ -108,6 +348,10 @@ int main(int argc, const char** argv)
     int key = 0;
     int frame_count = 0;
 
+    if (batch) {
+        return run_batch(jobs, r, pos_id, ind_id);
+    }
+
     if (command_line) {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
 
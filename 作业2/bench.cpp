@@ -0,0 +1,769 @@
+//
+// Benchmark of the rasterizer's hot paths on fixed workloads, with golden image checks.
+//
+// bench [--iterations N] [--threads N] [--simd scalar|sse|avx2] [--sizes WxH,WxH...] [--filter name]
+//       [--json FILE|-] [--trace FILE] [--update-golden]
+//
+// Every workload is drawn at every size; the frame is hashed and compared with the hash recorded in
+// golden below, so an optimisation that changes a single pixel fails the run (exit code 1); sizes without
+// a recorded hash are reported as missing.
+// --update-golden prints the table for the current output instead. The hashes hold for builds that do
+// not contract float multiply-adds (MSVC x64 and GCC/Clang without -ffp-contract=fast and FMA targets).
+//
+// Built with RST_STATS=1 the JSON output carries the pipeline counters of the last frame of every run, and
+// --trace writes the stage timings of every timed frame in the Chrome trace format.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "rasterizer.hpp"
+#include "texture.hpp"
+
+namespace
+{
+    // Same numbers on every platform, unlike the distributions of <random>
+    struct lcg
+    {
+        std::uint64_t state;
+
+        float next()
+        {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            return (float)(state >> 40) / (float)(1 << 24);
+        }
+
+        float range(float lo, float hi)
+        {
+            return lo + (hi - lo) * next();
+        }
+    };
+
+    struct scene
+    {
+        std::vector<Eigen::Vector3f> positions, colors;
+        std::vector<Eigen::Vector3i> indices;
+        // Pixels the triangles cover, or the lines light, per frame
+        double pixels = 0;
+        // Draw calls the triangles are split into, in order
+        int draws = 1;
+        // Vertical field of view in degrees of a perspective camera at the origin looking down -z; 0 draws
+        // the positions as normalised device coordinates
+        float fov = 0;
+    };
+
+    // count triangles about size pixels across, inside the screen, with random depth and colour
+    scene random_triangles(int width, int height, int count, float size, std::uint64_t seed)
+    {
+        scene s;
+        lcg rng{seed};
+        float sx = 2.0f / width, sy = 2.0f / height;
+        for (int i = 0; i < count; ++i)
+        {
+            float cx = rng.range(-1 + size * sx, 1 - size * sx);
+            float cy = rng.range(-1 + size * sy, 1 - size * sy);
+            float z = rng.range(-0.9f, 0.9f);
+            Eigen::Vector3f color(rng.range(0, 255), rng.range(0, 255), rng.range(0, 255));
+            Eigen::Vector2f p[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                p[k] = Eigen::Vector2f(rng.range(-size, size), rng.range(-size, size));
+                s.positions.emplace_back(cx + p[k].x() * 0.5f * sx, cy + p[k].y() * 0.5f * sy, z);
+                s.colors.push_back(color);
+            }
+            s.indices.emplace_back(3 * i, 3 * i + 1, 3 * i + 2);
+            s.pixels += 0.125 * std::abs((p[1] - p[0]).x() * (p[2] - p[0]).y() - (p[1] - p[0]).y() * (p[2] - p[0]).x());
+        }
+        return s;
+    }
+
+    /*
+     * The inside of a long box around a perspective camera at the origin, cells x cells quads per face with
+     * a random colour per vertex. Every pixel sees exactly one face, from up to 20 units away, so colours
+     * are interpolated across a wide range of depths. The camera sits just above the floor and off centre,
+     * so the floor triangles around it cross the near plane and reach far past the guard band; with a 30
+     * degree field of view the floor cut away by the near plane lies below the screen.
+     * */
+    scene inside_box(int width, int height, int cells, std::uint64_t seed)
+    {
+        scene s;
+        lcg rng{seed};
+        const Eigen::Vector3f lo(-1.2f, -0.03f, -20), hi(2.8f, 2.97f, 1);
+        for (int face = 0; face < 6; ++face)
+        {
+            int axis = face / 2, u = (axis + 1) % 3, v = (axis + 2) % 3;
+            bool high = face % 2 == 1;
+            int first = (int)s.positions.size();
+            for (int j = 0; j <= cells; ++j)
+            {
+                for (int i = 0; i <= cells; ++i)
+                {
+                    // Computed the same way on every face, so the faces meet without cracks
+                    Eigen::Vector3f p;
+                    p[axis] = high ? hi[axis] : lo[axis];
+                    p[u] = lo[u] + (hi[u] - lo[u]) * i / cells;
+                    p[v] = lo[v] + (hi[v] - lo[v]) * j / cells;
+                    s.positions.push_back(p);
+                    s.colors.emplace_back(rng.range(0, 255), rng.range(0, 255), rng.range(0, 255));
+                }
+            }
+            // The u x v normal points along +axis, so the faces on the high side are wound the other way to face inside
+            for (int j = 0; j < cells; ++j)
+            {
+                for (int i = 0; i < cells; ++i)
+                {
+                    int a = first + j * (cells + 1) + i, b = a + 1, c = a + cells + 1, d = c + 1;
+                    s.indices.push_back(high ? Eigen::Vector3i(a, d, b) : Eigen::Vector3i(a, b, d));
+                    s.indices.push_back(high ? Eigen::Vector3i(a, c, d) : Eigen::Vector3i(a, d, c));
+                }
+            }
+        }
+        s.pixels = (double)width * height;
+        s.fov = 30;
+        return s;
+    }
+
+    // OpenGL style projection of a camera at the origin looking down -z, near and far plane at depth -1 and 1
+    Eigen::Matrix4f perspective(float fov, float aspect, float z_near, float z_far)
+    {
+        float f = 1 / std::tan(fov * 3.14159265f / 360);
+        Eigen::Matrix4f p;
+        p << f / aspect, 0, 0, 0,
+             0, f, 0, 0,
+             0, 0, (z_far + z_near) / (z_near - z_far), 2 * z_far * z_near / (z_near - z_far),
+             0, 0, -1, 0;
+        return p;
+    }
+
+    // s with a random colour per vertex rather than per triangle, so that colours are interpolated
+    scene vertex_colors(scene s, std::uint64_t seed)
+    {
+        lcg rng{seed};
+        for (auto& c : s.colors)
+        {
+            c = Eigen::Vector3f(rng.range(0, 255), rng.range(0, 255), rng.range(0, 255));
+        }
+        return s;
+    }
+
+    // The triangles of s drawn one per draw call
+    scene one_per_draw(scene s)
+    {
+        s.draws = (int)s.indices.size();
+        return s;
+    }
+
+    // count quads over the whole screen, drawn from the back to the front so each one passes the depth test
+    scene screen_quads(int width, int height, int count)
+    {
+        scene s;
+        for (int i = 0; i < count; ++i)
+        {
+            float z = 0.9f - 1.8f * i / std::max(count - 1, 1);
+            int first = (int)s.positions.size();
+            Eigen::Vector3f color(255.0f * i / count, 128, 255 - 255.0f * i / count);
+            for (auto& corner : {Eigen::Vector2f(-1, -1), Eigen::Vector2f(1, -1), Eigen::Vector2f(1, 1), Eigen::Vector2f(-1, 1)})
+            {
+                s.positions.emplace_back(corner.x(), corner.y(), z);
+                s.colors.push_back(color);
+            }
+            s.indices.emplace_back(first, first + 1, first + 2);
+            s.indices.emplace_back(first, first + 2, first + 3);
+        }
+        s.pixels = (double)count * width * height;
+        return s;
+    }
+
+    // Pixels Bresenham lights for the edges of the triangles
+    double line_pixels(const scene& s, int width, int height)
+    {
+        double pixels = 0;
+        for (auto& t : s.indices)
+        {
+            for (int k = 0; k < 3; ++k)
+            {
+                Eigen::Vector3f a = s.positions[t[k]], b = s.positions[t[(k + 1) % 3]];
+                pixels += std::max(std::abs(a.x() - b.x()) * width / 2, std::abs(a.y() - b.y()) * height / 2) + 1;
+            }
+        }
+        return pixels;
+    }
+
+    // Colour interpolated perspective correctly from the vertices
+    struct color_shader
+    {
+        const Eigen::Vector3f* colors;
+
+        int varyings() const { return 3; }
+        std::uint32_t reads() const { return 0x7; }
+        Eigen::Vector4f vertex(int index, const Eigen::Vector3f& p, float* out) const
+        {
+            out[0] = colors[index].x();
+            out[1] = colors[index].y();
+            out[2] = colors[index].z();
+            return Eigen::Vector4f(p.x(), p.y(), p.z(), 1);
+        }
+        Eigen::Vector3f fragment(int, int, const float* in) const { return Eigen::Vector3f(in[0], in[1], in[2]); }
+    };
+
+    // color_shader behind virtual calls, as a prototype would write it
+    struct virtual_color_shader : rst::virtual_shader
+    {
+        const Eigen::Vector3f* colors;
+
+        explicit virtual_color_shader(const Eigen::Vector3f* colors) : colors(colors) {}
+
+        int varyings() const override { return 3; }
+        std::uint32_t reads() const override { return 0x7; }
+        Eigen::Vector4f vertex(int index, const Eigen::Vector3f& p, float* out) const override
+        {
+            return color_shader{colors}.vertex(index, p, out);
+        }
+        Eigen::Vector3f fragment(int, int, const float* in) const override { return Eigen::Vector3f(in[0], in[1], in[2]); }
+    };
+
+    // 512x512 texels of noise over a checkerboard, so that every mip level differs from the next
+    const rst::texture& noise_texture(rst::texture_layout layout)
+    {
+        auto make = [](rst::texture_layout layout) {
+            const int size = 512;
+            std::vector<unsigned char> data((size_t)size * size * 4);
+            lcg rng{9};
+            for (int y = 0; y < size; ++y)
+            {
+                for (int x = 0; x < size; ++x)
+                {
+                    unsigned char* t = &data[((size_t)y * size + x) * 4];
+                    float base = ((x / 32 + y / 32) & 1) ? 160.0f : 40.0f;
+                    t[0] = (unsigned char)(base + rng.range(0, 95));
+                    t[1] = (unsigned char)(255.0f * x / size);
+                    t[2] = (unsigned char)(base + rng.range(0, 95));
+                    t[3] = 255;
+                }
+            }
+            return rst::texture(size, size, 4, data.data(), layout);
+        };
+        static const rst::texture tiled = make(rst::texture_layout::Tiled);
+        static const rst::texture rows = make(rst::texture_layout::Rows);
+        return layout == rst::texture_layout::Rows ? rows : tiled;
+    }
+
+    // Trilinear samples of a texture at the screen position scaled by a factor per triangle, taken from its
+    // colour, so that the triangles minify the texture to different mip levels
+    struct texture_shader
+    {
+        const Eigen::Vector3f* colors;
+        const rst::texture* tex;
+
+        int varyings() const { return 2; }
+        std::uint32_t reads() const { return 0x3; }
+        Eigen::Vector4f vertex(int index, const Eigen::Vector3f& p, float* out) const
+        {
+            float scale = 1 + colors[index].x() / 32;
+            out[0] = p.x() * scale;
+            out[1] = p.y() * scale;
+            return Eigen::Vector4f(p.x(), p.y(), p.z(), 1);
+        }
+        Eigen::Vector3f fragment(int, int, const float* in, const float* ddx, const float* ddy) const
+        {
+            return tex->sample(in[0], in[1], ddx[0], ddx[1], ddy[0], ddy[1]).head<3>();
+        }
+    };
+
+    enum class draw_mode
+    {
+        Fixed,
+        Shaded,
+        Virtual,
+        Textured,
+        Lines
+    };
+
+    struct workload
+    {
+        const char* name;
+        const char* description;
+        std::function<scene(int, int)> make;
+        draw_mode mode;
+        int msaa;
+        rst::depth_format depth = rst::depth_format::Float32;
+        bool reversed_z = false;
+        // Translucent workloads are drawn at half alpha
+        rst::blend_mode blend = rst::blend_mode::Opaque;
+        // Texture storage of the textured workloads
+        rst::texture_layout layout = rst::texture_layout::Tiled;
+    };
+
+    const std::vector<workload>& workloads()
+    {
+        static const std::vector<workload> list = {
+            {"tiny", "200k triangles about 2 pixels across",
+             [](int w, int h) { return random_triangles(w, h, 200000, 2, 1); }, draw_mode::Fixed, 1},
+            {"huge", "8 full screen quads, front one last",
+             [](int w, int h) { return screen_quads(w, h, 8); }, draw_mode::Fixed, 1},
+            {"overdraw", "20k triangles about 60 pixels across",
+             [](int w, int h) { return random_triangles(w, h, 20000, 60, 2); }, draw_mode::Fixed, 1},
+            {"depth24", "the overdraw triangles with 24-bit depth",
+             [](int w, int h) { return random_triangles(w, h, 20000, 60, 2); }, draw_mode::Fixed, 1, rst::depth_format::Unorm24},
+            {"depth16", "the overdraw triangles with 16-bit depth",
+             [](int w, int h) { return random_triangles(w, h, 20000, 60, 2); }, draw_mode::Fixed, 1, rst::depth_format::Unorm16},
+            {"draws", "4000 draw calls of one triangle about 20 pixels across",
+             [](int w, int h) { return one_per_draw(random_triangles(w, h, 4000, 20, 8)); }, draw_mode::Fixed, 1},
+            {"draws24", "the draw calls with 24-bit depth",
+             [](int w, int h) { return one_per_draw(random_triangles(w, h, 4000, 20, 8)); }, draw_mode::Fixed, 1,
+             rst::depth_format::Unorm24},
+            {"draws16", "the draw calls with 16-bit depth",
+             [](int w, int h) { return one_per_draw(random_triangles(w, h, 4000, 20, 8)); }, draw_mode::Fixed, 1,
+             rst::depth_format::Unorm16},
+            {"revz", "the overdraw triangles with reversed-Z",
+             [](int w, int h) { return random_triangles(w, h, 20000, 60, 2); }, draw_mode::Fixed, 1,
+             rst::depth_format::Float32, true},
+            {"revz24", "the overdraw triangles with reversed-Z 24-bit depth",
+             [](int w, int h) { return random_triangles(w, h, 20000, 60, 2); }, draw_mode::Fixed, 1,
+             rst::depth_format::Unorm24, true},
+            {"revz16", "the overdraw triangles with reversed-Z 16-bit depth",
+             [](int w, int h) { return random_triangles(w, h, 20000, 60, 2); }, draw_mode::Fixed, 1,
+             rst::depth_format::Unorm16, true},
+            {"glass", "the overdraw triangles alpha blended",
+             [](int w, int h) { return random_triangles(w, h, 20000, 60, 2); }, draw_mode::Fixed, 1,
+             rst::depth_format::Float32, false, rst::blend_mode::Alpha},
+            {"oit", "the overdraw triangles with order-independent transparency",
+             [](int w, int h) { return random_triangles(w, h, 20000, 60, 2); }, draw_mode::Fixed, 1,
+             rst::depth_format::Float32, false, rst::blend_mode::OrderIndependent},
+            {"msaa4", "20k triangles about 20 pixels across, 4x MSAA",
+             [](int w, int h) { return random_triangles(w, h, 20000, 20, 3); }, draw_mode::Fixed, 4},
+            {"revz16x4", "the 4x MSAA triangles with reversed-Z 16-bit depth",
+             [](int w, int h) { return random_triangles(w, h, 20000, 20, 3); }, draw_mode::Fixed, 4,
+             rst::depth_format::Unorm16, true},
+            {"shaded", "20k triangles about 20 pixels across with vertex colours, interpolating shader",
+             [](int w, int h) { return vertex_colors(random_triangles(w, h, 20000, 20, 4), 10); }, draw_mode::Shaded, 1},
+            {"virtual", "the shaded triangles through a virtual_shader",
+             [](int w, int h) { return vertex_colors(random_triangles(w, h, 20000, 20, 4), 10); }, draw_mode::Virtual, 1},
+            {"vcolor", "the shaded triangles with the built-in colour interpolation",
+             [](int w, int h) { return vertex_colors(random_triangles(w, h, 20000, 20, 4), 10); }, draw_mode::Fixed, 1},
+            {"textured", "20k triangles about 20 pixels across, trilinear texture in Morton tiles",
+             [](int w, int h) { return random_triangles(w, h, 20000, 20, 7); }, draw_mode::Textured, 1},
+            {"texrows", "the textured triangles with the texture stored in rows",
+             [](int w, int h) { return random_triangles(w, h, 20000, 20, 7); }, draw_mode::Textured, 1,
+             rst::depth_format::Float32, false, rst::blend_mode::Opaque, rst::texture_layout::Rows},
+            {"tunnel", "inside of a box of 19k triangles in perspective, clipped at the near plane and guard band",
+             [](int w, int h) { return inside_box(w, h, 40, 11); }, draw_mode::Fixed, 1},
+            {"sparse", "100 triangles about 20 pixels across, so clearing dominates",
+             [](int w, int h) { return random_triangles(w, h, 100, 20, 6); }, draw_mode::Fixed, 1},
+            {"lines", "wireframe of 20k triangles about 20 pixels across",
+             [](int w, int h) { return random_triangles(w, h, 20000, 20, 5); }, draw_mode::Lines, 1},
+        };
+        return list;
+    }
+
+    // FNV-1a of the frame, per workload and size
+    const std::map<std::string, std::uint64_t>& golden()
+    {
+        static const std::map<std::string, std::uint64_t> hashes = {
+            {"tiny@256x256", 0xd7f3fb2fa193b580ull},
+            {"tiny@700x700", 0x2d6ebc1e5e2605b6ull},
+            {"tiny@1920x1080", 0x6f06e89e5ecc4e08ull},
+            {"huge@256x256", 0xeaf4fba466e70383ull},
+            {"huge@700x700", 0x891ac94e857876e3ull},
+            {"huge@1920x1080", 0x3389a54f266e6b83ull},
+            {"overdraw@256x256", 0x875bddf0f77eb3f2ull},
+            {"overdraw@700x700", 0xa91df044671d0f64ull},
+            {"overdraw@1920x1080", 0x720ea50b4899a50cull},
+            {"depth24@256x256", 0x875bddf0f77eb3f2ull},
+            {"depth24@700x700", 0xa91df044671d0f64ull},
+            {"depth24@1920x1080", 0x720ea50b4899a50cull},
+            {"depth16@256x256", 0x875bddf0f77eb3f2ull},
+            {"depth16@700x700", 0xa91df044671d0f64ull},
+            {"depth16@1920x1080", 0x720ea50b4899a50cull},
+            {"draws@256x256", 0xc62316552679c388ull},
+            {"draws@700x700", 0xfab6d2b87397b699ull},
+            {"draws@1920x1080", 0xc99d367e3efd13d7ull},
+            {"draws24@256x256", 0xc62316552679c388ull},
+            {"draws24@700x700", 0xfab6d2b87397b699ull},
+            {"draws24@1920x1080", 0xc99d367e3efd13d7ull},
+            {"draws16@256x256", 0xc62316552679c388ull},
+            {"draws16@700x700", 0xfab6d2b87397b699ull},
+            {"draws16@1920x1080", 0xc99d367e3efd13d7ull},
+            {"revz@256x256", 0x80ec51e23eb16f93ull},
+            {"revz@700x700", 0x4414c35941c8180dull},
+            {"revz@1920x1080", 0xd6d519635234ceacull},
+            {"revz24@256x256", 0x80ec51e23eb16f93ull},
+            {"revz24@700x700", 0x4414c35941c8180dull},
+            {"revz24@1920x1080", 0xd6d519635234ceacull},
+            {"revz16@256x256", 0x80ec51e23eb16f93ull},
+            {"revz16@700x700", 0x4414c35941c8180dull},
+            {"revz16@1920x1080", 0xd6d519635234ceacull},
+            {"glass@256x256", 0x8d28cf5bf5b62812ull},
+            {"glass@700x700", 0xe2a58d502278aee7ull},
+            {"glass@1920x1080", 0x9e767535bc327e21ull},
+            {"oit@256x256", 0x2688c35dddbc2e76ull},
+            {"oit@700x700", 0x70dd341725dbe46eull},
+            {"oit@1920x1080", 0x7de7c12cee6e465eull},
+            {"msaa4@256x256", 0xd17be19dada544a2ull},
+            {"msaa4@700x700", 0x45ec64f464103f5dull},
+            {"msaa4@1920x1080", 0x4a76ed193ce5476full},
+            {"revz16x4@256x256", 0xe17d87efa0fd381dull},
+            {"revz16x4@700x700", 0xf208b1f5bc83b250ull},
+            {"revz16x4@1920x1080", 0x2533a99cf606f13aull},
+            {"shaded@256x256", 0x0f9d0391ae59027dull},
+            {"shaded@700x700", 0xb2466786d17593f7ull},
+            {"shaded@1920x1080", 0x02904e69f75c34c2ull},
+            {"virtual@256x256", 0x0f9d0391ae59027dull},
+            {"virtual@700x700", 0xb2466786d17593f7ull},
+            {"virtual@1920x1080", 0x02904e69f75c34c2ull},
+            {"vcolor@256x256", 0x0f9d0391ae59027dull},
+            {"vcolor@700x700", 0xb2466786d17593f7ull},
+            {"vcolor@1920x1080", 0x02904e69f75c34c2ull},
+            {"textured@256x256", 0xf45d3d6a60916587ull},
+            {"textured@700x700", 0x317a3a51414b2795ull},
+            {"textured@1920x1080", 0x7e737c8bde08ca55ull},
+            {"texrows@256x256", 0xf45d3d6a60916587ull},
+            {"texrows@700x700", 0x317a3a51414b2795ull},
+            {"texrows@1920x1080", 0x7e737c8bde08ca55ull},
+            {"tunnel@256x256", 0x9b5bb6bebb47e928ull},
+            {"tunnel@700x700", 0x76290c779692ca0bull},
+            {"tunnel@1920x1080", 0x5493f8673ad4847bull},
+            {"sparse@256x256", 0xb502f86aea6a799aull},
+            {"sparse@700x700", 0x1efe5cf28ab0ad39ull},
+            {"sparse@1920x1080", 0xf058afc97e1f6d98ull},
+            {"lines@256x256", 0x0495cb2b342b0fceull},
+            {"lines@700x700", 0x1ccfd3ce34e4425eull},
+            {"lines@1920x1080", 0x25cef109ec250aeeull},
+        };
+        return hashes;
+    }
+
+    std::uint64_t hash_frame(const std::vector<unsigned char>& frame)
+    {
+        std::uint64_t h = 1469598103934665603ull;
+        for (unsigned char b : frame)
+        {
+            h = (h ^ b) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    struct result
+    {
+        std::string workload;
+        int width, height;
+        size_t triangles;
+        double pixels;
+        int iterations;
+        double best_ms, mean_ms;
+        std::uint64_t hash;
+        std::string golden;
+        rst::frame_stats stats;
+    };
+
+    std::string key(const workload& w, int width, int height)
+    {
+        return std::string(w.name) + "@" + std::to_string(width) + "x" + std::to_string(height);
+    }
+
+    // One warm-up frame, then `iterations` timed frames of clear, draw and end_frame, whose statistics go
+    // to trace
+    result run(const workload& w, int width, int height, int iterations, int threads, rst::simd_level simd,
+               std::vector<rst::frame_stats>& trace)
+    {
+        scene s = w.make(width, height);
+        if (w.mode == draw_mode::Lines)
+        {
+            s.pixels = line_pixels(s, width, height);
+        }
+
+        rst::rasterizer r(width, height, rst::pixel_format::BGRA8);
+        r.set_thread_count(threads);
+        r.set_simd_level(simd);
+        r.set_msaa(w.msaa);
+        r.set_depth_format(w.depth);
+        r.set_reversed_z(w.reversed_z);
+        r.set_blend(w.blend, w.blend == rst::blend_mode::Opaque ? 1.0f : 0.5f);
+        r.set_model(Eigen::Matrix4f::Identity());
+        r.set_view(Eigen::Matrix4f::Identity());
+        r.set_projection(Eigen::Matrix4f::Identity());
+        if (s.fov > 0)
+        {
+            r.set_projection(perspective(s.fov, (float)width / height, 0.1f, 50));
+            r.set_depth_clip(true);
+        }
+
+        // Every draw call gets its own buffers with just the vertices of its triangles
+        struct draw_call
+        {
+            rst::pos_buf_id positions;
+            rst::ind_buf_id indices;
+            rst::col_buf_id colors;
+            color_shader shader;
+            virtual_color_shader virtual_shader;
+            texture_shader textured;
+        };
+        std::vector<draw_call> draws;
+        size_t triangles = s.indices.size();
+        for (int d = 0; d < s.draws; ++d)
+        {
+            std::vector<Eigen::Vector3i> indices(s.indices.begin() + triangles * d / s.draws,
+                                                 s.indices.begin() + triangles * (d + 1) / s.draws);
+            if (indices.empty())
+            {
+                continue;
+            }
+            int first = (int)s.positions.size(), last = -1;
+            for (auto& t : indices)
+            {
+                first = std::min(first, t.minCoeff());
+                last = std::max(last, t.maxCoeff());
+            }
+            for (auto& t : indices)
+            {
+                t -= Eigen::Vector3i::Constant(first);
+            }
+            const Eigen::Vector3f* colors = s.colors.data() + first;
+            draws.push_back({r.load_positions(std::vector<Eigen::Vector3f>(s.positions.begin() + first, s.positions.begin() + last + 1)),
+                             r.load_indices(std::move(indices)),
+                             r.load_colors(std::vector<Eigen::Vector3f>(colors, colors + (last - first + 1))),
+                             color_shader{colors}, virtual_color_shader(colors), texture_shader{colors, &noise_texture(w.layout)}});
+        }
+
+        auto frame = [&] {
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            for (auto& d : draws)
+            {
+                switch (w.mode)
+                {
+                case draw_mode::Fixed:
+                    r.draw(d.positions, d.indices, d.colors, rst::Primitive::Triangle);
+                    break;
+                case draw_mode::Shaded:
+                    r.draw(d.positions, d.indices, d.shader);
+                    break;
+                case draw_mode::Virtual:
+                    r.draw(d.positions, d.indices, static_cast<const rst::virtual_shader&>(d.virtual_shader));
+                    break;
+                case draw_mode::Textured:
+                    r.draw(d.positions, d.indices, d.textured);
+                    break;
+                case draw_mode::Lines:
+                    r.draw(d.positions, d.indices, d.colors, rst::Primitive::Line);
+                    break;
+                }
+            }
+            r.end_frame();
+        };
+
+        frame();
+        double best = 0, total = 0;
+        for (int i = 0; i < iterations; ++i)
+        {
+            auto start = std::chrono::steady_clock::now();
+            frame();
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            best = i == 0 ? ms : std::min(best, ms);
+            total += ms;
+            if (rst::stats_enabled)
+            {
+                trace.push_back(r.stats());
+            }
+        }
+
+        result res{w.name, width, height, triangles, s.pixels, iterations, best, total / iterations,
+                   hash_frame(r.frame_buffer()), "", r.stats()};
+        auto g = golden().find(key(w, width, height));
+        res.golden = g == golden().end() ? "missing" : g->second == res.hash ? "ok" : "MISMATCH";
+        return res;
+    }
+
+    void write_results(std::ostream& out, const std::vector<result>& results, int threads, const char* simd)
+    {
+        out << "{\n  \"threads\": " << threads << ",\n  \"simd\": \"" << simd << "\",\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const result& r = results[i];
+            char hash[17];
+            std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)r.hash);
+            out << (i ? ",\n" : "\n") << "    {\"workload\": \"" << r.workload << "\", \"width\": " << r.width
+                << ", \"height\": " << r.height << ", \"triangles\": " << r.triangles
+                << ", \"pixels\": " << (long long)r.pixels << ", \"iterations\": " << r.iterations
+                << ", \"best_ms\": " << r.best_ms << ", \"mean_ms\": " << r.mean_ms
+                << ", \"triangles_per_s\": " << r.triangles / (r.best_ms * 1e-3)
+                << ", \"pixels_per_s\": " << r.pixels / (r.best_ms * 1e-3)
+                << ", \"ns_per_pixel\": " << r.best_ms * 1e6 / r.pixels
+                << ", \"hash\": \"" << hash << "\", \"golden\": \"" << r.golden << '"';
+            if (rst::stats_enabled)
+            {
+                out << ", \"stats\": ";
+                rst::write_json(out, r.stats);
+            }
+            out << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    std::vector<std::pair<int, int>> parse_sizes(const std::string& list)
+    {
+        std::vector<std::pair<int, int>> sizes;
+        std::stringstream in(list);
+        std::string item;
+        while (std::getline(in, item, ','))
+        {
+            int w = 0, h = 0;
+            char x = 0;
+            std::stringstream size(item);
+            if (!(size >> w >> x >> h) || x != 'x' || w <= 0 || h <= 0)
+            {
+                throw std::runtime_error("Sizes are given as WxH, not " + item);
+            }
+            sizes.emplace_back(w, h);
+        }
+        return sizes;
+    }
+
+    void usage()
+    {
+        std::cerr << "bench [--iterations N] [--threads N] [--simd scalar|sse|avx2] [--sizes WxH,...]\n"
+                     "      [--filter name] [--json FILE|-] [--trace FILE] [--update-golden]\n\nWorkloads:\n";
+        for (auto& w : workloads())
+        {
+            std::cerr << "  " << w.name << ": " << w.description << "\n";
+        }
+    }
+}
+
+int main(int argc, const char** argv)
+{
+    int iterations = 10, threads = 0;
+    rst::simd_level simd = rst::simd_level::AVX2;
+    const char* simd_name = "avx2";
+    std::vector<std::pair<int, int>> sizes = {{256, 256}, {700, 700}, {1920, 1080}};
+    std::string filter, json, trace_file;
+    bool update = false;
+
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--update-golden")
+            {
+                update = true;
+            }
+            else if (arg == "--iterations" && has_value)
+            {
+                iterations = std::max(std::stoi(argv[++i]), 1);
+            }
+            else if (arg == "--threads" && has_value)
+            {
+                threads = std::stoi(argv[++i]);
+            }
+            else if (arg == "--simd" && has_value)
+            {
+                simd_name = argv[++i];
+                std::string level = simd_name;
+                if (level == "scalar")
+                    simd = rst::simd_level::Scalar;
+                else if (level == "sse")
+                    simd = rst::simd_level::SSE;
+                else if (level == "avx2")
+                    simd = rst::simd_level::AVX2;
+                else
+                    throw std::runtime_error("Unknown SIMD level " + level);
+            }
+            else if (arg == "--sizes" && has_value)
+            {
+                sizes = parse_sizes(argv[++i]);
+            }
+            else if (arg == "--filter" && has_value)
+            {
+                filter = argv[++i];
+            }
+            else if (arg == "--json" && has_value)
+            {
+                json = argv[++i];
+            }
+            else if (arg == "--trace" && has_value)
+            {
+                trace_file = argv[++i];
+                if (!rst::stats_enabled)
+                {
+                    throw std::runtime_error("--trace needs a build with RST_STATS=1");
+                }
+            }
+            else
+            {
+                usage();
+                return 2;
+            }
+        }
+
+        std::vector<result> results;
+        std::vector<rst::frame_stats> trace;
+        int failures = 0;
+        for (auto& w : workloads())
+        {
+            if (!filter.empty() && std::string(w.name).find(filter) == std::string::npos)
+            {
+                continue;
+            }
+            for (auto& size : sizes)
+            {
+                result r = run(w, size.first, size.second, iterations, threads, simd, trace);
+                std::printf("%-9s %4dx%-4d %9.3f ms best %9.3f ms mean %8.2f Mtri/s %9.2f Mpix/s %7.3f ns/pix  %s\n",
+                            r.workload.c_str(), r.width, r.height, r.best_ms, r.mean_ms,
+                            r.triangles / (r.best_ms * 1e3), r.pixels / (r.best_ms * 1e3),
+                            r.best_ms * 1e6 / r.pixels, r.golden.c_str());
+                std::fflush(stdout);
+                failures += r.golden == "MISMATCH";
+                results.push_back(r);
+            }
+        }
+
+        if (update)
+        {
+            for (auto& r : results)
+            {
+                std::printf("            {\"%s@%dx%d\", 0x%016llxull},\n", r.workload.c_str(), r.width, r.height,
+                            (unsigned long long)r.hash);
+            }
+        }
+        if (json == "-")
+        {
+            write_results(std::cout, results, threads, simd_name);
+        }
+        else if (!json.empty())
+        {
+            std::ofstream out(json);
+            write_results(out, results, threads, simd_name);
+            if (!out)
+            {
+                throw std::runtime_error("Cannot write " + json);
+            }
+        }
+        if (!trace_file.empty())
+        {
+            std::ofstream out(trace_file);
+            rst::write_chrome_trace(out, trace);
+            if (!out)
+            {
+                throw std::runtime_error("Cannot write " + trace_file);
+            }
+        }
+        return update || failures == 0 ? 0 : 1;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+}
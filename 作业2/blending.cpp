@@ -0,0 +1,72 @@
+//
+// Blend modes of translucent draws and the accumulation of order-independent transparency.
+//
+
+#include "blending.hpp"
+#include <algorithm>
+
+void rst::blend_pixel(blend_mode mode, pixel_format format, const Eigen::Vector4f& src, void* dst)
+{
+    // Every direct mode is dst * scale + add per channel
+    float a = std::min(std::max(src.w(), 0.0f), 1.0f);
+    float scale[3], add[3];
+    for (int c = 0; c < 3; ++c)
+    {
+        switch (mode)
+        {
+        case blend_mode::Additive:
+            scale[c] = 1;
+            add[c] = src[c] * a;
+            break;
+        case blend_mode::Multiply:
+            scale[c] = src[c] * (a / 255.0f) + (1 - a);
+            add[c] = 0;
+            break;
+        default:
+            scale[c] = 1 - a;
+            add[c] = src[c] * a;
+            break;
+        }
+    }
+
+    if (format == pixel_format::RGBA8 || format == pixel_format::BGRA8)
+    {
+        // Straight on the bytes: decode_pixel and encode_pixel would cost more than the blend
+        unsigned char* p = (unsigned char*)dst;
+        for (int c = 0; c < 3; ++c)
+        {
+            unsigned char& v = p[format == pixel_format::BGRA8 ? 2 - c : c];
+            v = (unsigned char)(std::min(std::max(v * scale[c] + add[c], 0.0f), 255.0f) + 0.5f);
+        }
+        return;
+    }
+    Eigen::Vector3f back = decode_pixel(format, dst);
+    for (int c = 0; c < 3; ++c)
+    {
+        back[c] = back[c] * scale[c] + add[c];
+    }
+    encode_pixel(format, back, dst);
+}
+
+// Weight of equation 10 of the paper, for depths in 0..1: large for fragments near the camera, so they
+// dominate those behind them
+void rst::accumulate(oit_pixel& pixel, const Eigen::Vector4f& src, float depth, float coverage)
+{
+    float a = std::min(std::max(src.w() * coverage, 0.0f), 1.0f);
+    float d = 1 - std::min(std::max(depth, 0.0f), 1.0f);
+    float w = a * std::max(1e-2f, 3e3f * d * d * d);
+    for (int c = 0; c < 3; ++c)
+    {
+        pixel.color[c] += src[c] * a * w;
+    }
+    pixel.weight += a * w;
+    pixel.revealage *= 1 - a;
+}
+
+Eigen::Vector3f rst::composite(const oit_pixel& pixel, const Eigen::Vector3f& background)
+{
+    // Clamped as in the paper, so that weights that underflowed or overflowed give no NaN or infinity
+    float weight = std::min(std::max(pixel.weight, 1e-4f), 5e4f);
+    Eigen::Vector3f color(pixel.color[0], pixel.color[1], pixel.color[2]);
+    return color / weight * (1 - pixel.revealage) + background * pixel.revealage;
+}
@@ -0,0 +1,50 @@
+//
+// Blend modes of translucent draws and the accumulation of order-independent transparency.
+//
+
+#pragma once
+
+#include <Eigen/Eigen>
+#include "pixel_format.hpp"
+
+namespace rst
+{
+    /*
+     * How a draw combines its colour src (RGB in 0..255) and alpha a (0..1) with the colour dst already in
+     * the frame. Opaque replaces dst and writes depth; the other modes test depth but do not write it.
+     *
+     *   Alpha:            src * a + dst * (1 - a)
+     *   Additive:         dst + src * a
+     *   Multiply:         dst * (src / 255 * a + 1 - a)
+     *   OrderIndependent: weighted blended order-independent transparency (McGuire and Bavoil): fragments
+     *                     are accumulated per pixel with a weight that falls with depth and composited over
+     *                     the frame by rasterizer::resolve, so the result does not depend on the order in
+     *                     which they are drawn. It approximates Alpha, closely for low alphas.
+     * */
+    enum class blend_mode
+    {
+        Opaque,
+        Alpha,
+        Additive,
+        Multiply,
+        OrderIndependent
+    };
+
+    // Translucent fragments of a pixel for blend_mode::OrderIndependent: the sums of their weighted,
+    // premultiplied colours and of their weighted alphas, and the product of their transparencies
+    struct oit_pixel
+    {
+        float color[3] = {0, 0, 0};
+        float weight = 0;
+        float revealage = 1;
+    };
+
+    // Blends src over the pixel at dst, of the given format, with one of the direct modes (not OrderIndependent)
+    void blend_pixel(blend_mode mode, pixel_format format, const Eigen::Vector4f& src, void* dst);
+
+    // Adds a fragment at depth (0 at the near to 1 at the far plane) covering that fraction of the pixel
+    void accumulate(oit_pixel& pixel, const Eigen::Vector4f& src, float depth, float coverage);
+
+    // The accumulated fragments over the colour background
+    Eigen::Vector3f composite(const oit_pixel& pixel, const Eigen::Vector3f& background);
+}
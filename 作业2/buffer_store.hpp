@@ -0,0 +1,129 @@
+//
+// Flat storage for the vertex, index and colour buffers of the rasterizer.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace rst
+{
+    // Read-only view of the elements of a buffer
+    template <typename T>
+    struct buffer_span
+    {
+        const T* data = nullptr;
+        std::size_t size = 0;
+
+        const T& operator[](std::size_t i) const { return data[i]; }
+        const T* begin() const { return data; }
+        const T* end() const { return data + size; }
+    };
+
+    /*
+     * Buffers live in a flat array of slots and are addressed by an id holding the slot index in its low
+     * bits and the slot's generation in the high ones, so a lookup is an array access and an id that was
+     * never handed out, or whose buffer has been unloaded (even if the slot was reused since), is
+     * reported instead of silently reading an empty buffer. A buffer either owns its elements (copied or
+     * moved in) or borrows memory the caller keeps alive, optionally through a shared owner such as a
+     * file mapping.
+     * */
+    template <typename T>
+    class buffer_store
+    {
+    public:
+        int add(std::vector<T>&& elements)
+        {
+            slot& s = allocate();
+            s.owned = std::move(elements);
+            s.view = {s.owned.data(), s.owned.size()};
+            return make_id(s);
+        }
+
+        int add(const T* data, std::size_t size, std::shared_ptr<const void> owner)
+        {
+            slot& s = allocate();
+            s.owner = std::move(owner);
+            s.view = {data, size};
+            return make_id(s);
+        }
+
+        void remove(int id)
+        {
+            slot& s = lookup(id);
+            s.live = false;
+            s.owned = std::vector<T>();
+            s.owner.reset();
+            s.view = {};
+            // Stale ids of this slot must not match the next buffer stored in it
+            s.generation = s.generation % max_generation + 1;
+            free_slots.push_back(int(&s - slots.data()));
+        }
+
+        bool contains(int id) const
+        {
+            int index = id & slot_mask;
+            return index < (int)slots.size() && slots[index].live && slots[index].generation == (id >> slot_bits);
+        }
+
+        // Returned by value: the slot array may reallocate when another buffer is added
+        buffer_span<T> get(int id) const
+        {
+            return const_cast<buffer_store*>(this)->lookup(id).view;
+        }
+
+    private:
+        static constexpr int slot_bits = 22;
+        static constexpr int slot_mask = (1 << slot_bits) - 1;
+        static constexpr int max_generation = (1 << (31 - slot_bits)) - 1;
+
+        struct slot
+        {
+            buffer_span<T> view;
+            std::vector<T> owned;
+            std::shared_ptr<const void> owner;
+            int generation = 1;
+            bool live = false;
+        };
+
+        slot& allocate()
+        {
+            if (free_slots.empty())
+            {
+                if ((int)slots.size() > slot_mask)
+                {
+                    throw std::runtime_error("Too many buffers loaded");
+                }
+                slots.emplace_back();
+                slots.back().live = true;
+                return slots.back();
+            }
+            slot& s = slots[free_slots.back()];
+            free_slots.pop_back();
+            s.live = true;
+            return s;
+        }
+
+        int make_id(const slot& s) const
+        {
+            return (s.generation << slot_bits) | int(&s - slots.data());
+        }
+
+        slot& lookup(int id)
+        {
+            if (!contains(id))
+            {
+                throw std::runtime_error("Invalid buffer id " + std::to_string(id));
+            }
+            return slots[id & slot_mask];
+        }
+
+        std::vector<slot> slots;
+        std::vector<int> free_slots;
+    };
+}
@@ -0,0 +1,132 @@
+//
+// Storage formats of the depth buffer and conversion from the rasterizer's float depths.
+//
+
+#include "depth_format.hpp"
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RST_X86 1
+#include <emmintrin.h>
+#endif
+
+// Depth of the stored range 0..1, NaN taken as the near plane
+static inline float toUnit(float depth, bool reversed_z)
+{
+    float v = reversed_z ? -depth : depth;
+    return v > 0 ? (v < 1 ? v : 1) : 0;
+}
+
+int rst::bytes_per_depth(depth_format format)
+{
+    switch (format)
+    {
+    case depth_format::Float32:
+        return 4;
+    case depth_format::Unorm24:
+        return 3;
+    case depth_format::Unorm16:
+        return 2;
+    }
+    return 0;
+}
+
+float rst::far_depth(depth_format format, bool reversed_z)
+{
+    if (format == depth_format::Float32)
+    {
+        return std::numeric_limits<float>::infinity();
+    }
+    return reversed_z ? 0.0f : 1.0f;
+}
+
+void rst::pack_depth(depth_format format, bool reversed_z, const float* src, std::size_t count, unsigned char* dst)
+{
+    switch (format)
+    {
+    case depth_format::Float32:
+        std::memcpy(dst, src, count * sizeof(float));
+        break;
+    case depth_format::Unorm24:
+        // In double, as float cannot tell every 24-bit step apart once multiplied out
+        for (std::size_t i = 0; i < count; ++i, dst += 3)
+        {
+            std::uint32_t q = (std::uint32_t)(toUnit(src[i], reversed_z) * 16777215.0 + 0.5);
+            dst[0] = (unsigned char)q;
+            dst[1] = (unsigned char)(q >> 8);
+            dst[2] = (unsigned char)(q >> 16);
+        }
+        break;
+    case depth_format::Unorm16:
+    {
+        std::size_t i = 0;
+#ifdef RST_X86
+        // Same steps as toUnit below, 8 depths at a time; max returns 0 for NaN as its second operand
+        const __m128 sign = _mm_set1_ps(reversed_z ? -1.0f : 1.0f);
+        const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+        const __m128 scale = _mm_set1_ps(65535.0f), half = _mm_set1_ps(0.5f);
+        const __m128i bias = _mm_set1_epi32(32768);
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128 lo = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + i), sign), zero), one);
+            __m128 hi = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), sign), zero), one);
+            __m128i qlo = _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(lo, scale), half)), bias);
+            __m128i qhi = _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(hi, scale), half)), bias);
+            // SSE2 only packs with signed saturation, hence the detour through -32768..32767
+            __m128i q = _mm_xor_si128(_mm_packs_epi32(qlo, qhi), _mm_set1_epi16(-32768));
+            _mm_storeu_si128((__m128i*)(dst + i * 2), q);
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            std::uint16_t q = (std::uint16_t)(toUnit(src[i], reversed_z) * 65535.0f + 0.5f);
+            std::memcpy(dst + i * 2, &q, 2);
+        }
+        break;
+    }
+    }
+}
+
+void rst::unpack_depth(depth_format format, bool reversed_z, const unsigned char* src, std::size_t count, float* dst)
+{
+    const float sign = reversed_z ? -1.0f : 1.0f;
+    switch (format)
+    {
+    case depth_format::Float32:
+        std::memcpy(dst, src, count * sizeof(float));
+        break;
+    case depth_format::Unorm24:
+        // Multiplying by the reciprocal rounds to the same float as dividing for every one of the 2^24
+        // values, without a division per depth
+        for (std::size_t i = 0; i < count; ++i, src += 3)
+        {
+            std::uint32_t q = src[0] | (std::uint32_t)src[1] << 8 | (std::uint32_t)src[2] << 16;
+            dst[i] = sign * (float)(q * (1.0 / 16777215.0));
+        }
+        break;
+    case depth_format::Unorm16:
+    {
+        std::size_t i = 0;
+#ifdef RST_X86
+        const __m128 scale = _mm_set1_ps(sign / 65535.0f);
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128i q = _mm_loadu_si128((const __m128i*)(src + i * 2));
+            _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(q, zero)), scale));
+            _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(q, zero)), scale));
+        }
+#endif
+        const float scale1 = sign / 65535.0f;
+        for (; i < count; ++i)
+        {
+            std::uint16_t q;
+            std::memcpy(&q, src + i * 2, 2);
+            dst[i] = (float)q * scale1;
+        }
+        break;
+    }
+    }
+}
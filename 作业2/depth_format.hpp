@@ -0,0 +1,35 @@
+//
+// Storage formats of the depth buffer and conversion from the rasterizer's float depths.
+//
+
+#pragma once
+
+#include <cstddef>
+
+namespace rst
+{
+    /*
+     * Float32 stores the depths as they are. The unsigned normalised formats store depth in 0..1 (the
+     * near to the far plane) as 24 bits packed into three bytes, or as 16 bits, clamping what lies
+     * outside; they take 3/4 and 1/2 of the memory traffic of Float32.
+     * With reversed-Z the rasterizer's depths run from -1 at the near plane to 0 at the far one (see
+     * rasterizer::set_reversed_z); the normalised formats then store them negated.
+     * */
+    enum class depth_format
+    {
+        Float32,
+        Unorm24,
+        Unorm16
+    };
+
+    int bytes_per_depth(depth_format format);
+
+    // Depth of a cleared buffer: infinitely far for Float32, the far plane for the normalised formats
+    float far_depth(depth_format format, bool reversed_z);
+
+    // Converts count depths to the format, rounding to the nearest value it can hold
+    void pack_depth(depth_format format, bool reversed_z, const float* src, std::size_t count, unsigned char* dst);
+
+    // Inverse of pack_depth
+    void unpack_depth(depth_format format, bool reversed_z, const unsigned char* src, std::size_t count, float* dst);
+}
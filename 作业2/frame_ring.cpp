@@ -0,0 +1,175 @@
+//
+// Ring of colour targets handed between the rasterizer and a consumer thread without copies.
+//
+
+#include "frame_ring.hpp"
+#include <stdexcept>
+
+rst::frame_ring::frame_ring(int w, int h, pixel_format format, int count) : width(w), height(h), fmt(format)
+{
+    if (count < 1)
+    {
+        throw std::runtime_error("A frame ring needs at least one buffer!");
+    }
+    buffers.resize(count);
+    for (auto& buffer : buffers)
+    {
+        buffer.resize((size_t)w * h * bytes_per_pixel(format));
+    }
+    states.assign(count, state::Free);
+    states[rendering] = state::Rendering;
+}
+
+rst::frame_ring::~frame_ring()
+{
+    stop_consumer();
+}
+
+void rst::frame_ring::set_consumer(std::function<void(const frame&)> callback)
+{
+    stop_consumer();
+    consume = std::move(callback);
+    if (consume)
+    {
+        stopping = false;
+        consumer = std::thread(&frame_ring::consumer_loop, this);
+    }
+}
+
+std::vector<unsigned char>& rst::frame_ring::acquire()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    rethrow_consumer_error();
+    if (states[rendering] == state::Rendering)
+    {
+        return buffers[rendering];
+    }
+
+    // Prefer the buffer after the last one so a frame just submitted is not reused first
+    for (;;)
+    {
+        for (int k = 1; k <= size(); ++k)
+        {
+            int candidate = (rendering + k) % size();
+            if (states[candidate] == state::Free)
+            {
+                rendering = candidate;
+                states[rendering] = state::Rendering;
+                return buffers[rendering];
+            }
+        }
+        changed.wait(guard);
+    }
+}
+
+void rst::frame_ring::submit()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    // The render target stays with the caller, so the frame can still be submitted after the exception
+    rethrow_consumer_error();
+    if (states[rendering] != state::Rendering)
+    {
+        return;
+    }
+    if (consume)
+    {
+        states[rendering] = state::Queued;
+        queue.emplace_back(rendering, submitted++);
+        changed.notify_all();
+    }
+    else
+    {
+        states[rendering] = state::Free;
+        ++submitted;
+    }
+}
+
+void rst::frame_ring::wait_idle()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [this] { return queue.empty() && !consuming; });
+    rethrow_consumer_error();
+}
+
+void rst::frame_ring::finish()
+{
+    stop_consumer();
+    std::lock_guard<std::mutex> guard(lock);
+    rethrow_consumer_error();
+}
+
+void rst::frame_ring::rethrow_consumer_error()
+{
+    if (error)
+    {
+        std::exception_ptr e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+void rst::frame_ring::consumer_loop()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;)
+    {
+        changed.wait(guard, [this] { return stopping || !queue.empty(); });
+        if (queue.empty())
+        {
+            return;
+        }
+
+        auto job = queue.front();
+        queue.pop_front();
+        // Frames queued while an exception waits for the rendering thread are dropped
+        if (error)
+        {
+            if (states[job.first] == state::Queued)
+            {
+                states[job.first] = state::Free;
+            }
+            changed.notify_all();
+            continue;
+        }
+        consuming = true;
+        guard.unlock();
+
+        // An exception must not leave the consumer thread; the rendering thread rethrows it
+        std::exception_ptr failure;
+        try
+        {
+            consume(frame{buffers[job.first].data(), width, height, fmt, job.second});
+        }
+        catch (...)
+        {
+            failure = std::current_exception();
+        }
+
+        guard.lock();
+        if (failure)
+        {
+            error = failure;
+        }
+        consuming = false;
+        if (states[job.first] == state::Queued)
+        {
+            states[job.first] = state::Free;
+        }
+        changed.notify_all();
+    }
+}
+
+void rst::frame_ring::stop_consumer()
+{
+    if (!consumer.joinable())
+    {
+        return;
+    }
+    {
+        // The consumer drains the queue before it sees the stop request
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    consumer.join();
+}
@@ -0,0 +1,96 @@
+//
+// Ring of colour targets handed between the rasterizer and a consumer thread without copies.
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "pixel_format.hpp"
+
+namespace rst
+{
+    // A finished frame as seen by the consumer; data stays valid until the consumer returns
+    struct frame
+    {
+        const unsigned char* data;
+        int width, height;
+        pixel_format format;
+        long long number;
+    };
+
+    /*
+     * Owns a few frame buffers that cycle through three states: free, being rendered, and queued for or
+     * held by the consumer. acquire() blocks only while every buffer is still with the consumer, so the
+     * rasterizer renders frame N + 1 while the consumer thread encodes or writes frame N.
+     * */
+    class frame_ring
+    {
+    public:
+        frame_ring(int w, int h, pixel_format format, int count);
+        ~frame_ring();
+
+        frame_ring(const frame_ring&) = delete;
+        frame_ring& operator=(const frame_ring&) = delete;
+
+        int size() const { return (int)buffers.size(); }
+
+        // Buffer currently being rendered into
+        std::vector<unsigned char>& current() { return buffers[rendering]; }
+
+        /*
+         * Called on the consumer thread for every submitted frame, in submission order.
+         * Without a consumer, submitted frames are released straight away. If the callback throws, the
+         * frames queued behind it are released unconsumed and the exception is rethrown by the next
+         * acquire(), submit(), wait_idle() or finish() on the rendering thread.
+         * */
+        void set_consumer(std::function<void(const frame&)> callback);
+
+        // Make a free buffer the render target, waiting for the consumer if none is free
+        std::vector<unsigned char>& acquire();
+
+        // Hand the render target to the consumer. It stays readable through current() until the next acquire().
+        void submit();
+
+        // Wait until the consumer has processed every submitted frame
+        void wait_idle();
+
+        // Stop the consumer once it has processed every submitted frame, and rethrow what it threw. The
+        // destructor does the same but drops the exception.
+        void finish();
+
+    private:
+        enum class state
+        {
+            Free,
+            Rendering,
+            Queued
+        };
+
+        void consumer_loop();
+        void stop_consumer();
+        // Rethrow the exception of the consumer, if any, on the rendering thread; lock must be held
+        void rethrow_consumer_error();
+
+        int width, height;
+        pixel_format fmt;
+        std::vector<std::vector<unsigned char>> buffers;
+        std::vector<state> states;
+        int rendering = 0;
+        long long submitted = 0;
+
+        std::mutex lock;
+        std::condition_variable changed;
+        std::deque<std::pair<int, long long>> queue;
+        std::function<void(const frame&)> consume;
+        std::thread consumer;
+        bool consuming = false;
+        bool stopping = false;
+        std::exception_ptr error;
+    };
+}
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include "rasterizer.hpp"
+#include "mesh_loader.hpp"
 #include "global.hpp"
 #include "Triangle.hpp"
 
@@ -58,19 +59,44 @@ Eigen::Matrix4f get_projection_matrix(float eye_fov, float aspect_ratio, float z
     return projection;
 }
 
+// Centres a mesh at the origin and scales it into a sphere of radius 1.5, which the camera at (0, 0, 5)
+// sees whole
+Eigen::Matrix4f get_fit_matrix(const std::vector<Eigen::Vector3f>& positions)
+{
+    Eigen::Matrix4f fit = Eigen::Matrix4f::Identity();
+    if (positions.empty())
+    {
+        return fit;
+    }
+    Eigen::Vector3f lo = positions[0], hi = positions[0];
+    for (auto& p : positions)
+    {
+        lo = lo.cwiseMin(p);
+        hi = hi.cwiseMax(p);
+    }
+    Eigen::Vector3f centre = (lo + hi) / 2;
+    float radius = (hi - lo).norm() / 2;
+    float scale = radius > 0 ? 1.5f / radius : 1.0f;
+    fit << scale, 0, 0, -scale * centre.x(),
+           0, scale, 0, -scale * centre.y(),
+           0, 0, scale, -scale * centre.z(),
+           0, 0, 0, 1;
+    return fit;
+}
+
 int main(int argc, const char** argv)
 {
     float angle = 0;
     bool command_line = false;
     std::string filename = "output.png";
 
-    if (argc == 2)
+    if (argc >= 2)
     {
         command_line = true;
         filename = std::string(argv[1]);
     }
 
-    rst::rasterizer r(700, 700);
+    rst::rasterizer r(700, 700, rst::pixel_format::BGRA8);
 
     Eigen::Vector3f eye_pos = {0,0,5};
 
@@ -105,23 +131,46 @@ int main(int argc, const char** argv)
     auto ind_id = r.load_indices(ind);
     auto col_id = r.load_colors(cols);
 
+    Eigen::Matrix4f fit = Eigen::Matrix4f::Identity();
+    if (argc >= 3)
+    {
+        // Render the OBJ or PLY mesh given after the output file instead, framed by the camera
+        try
+        {
+            rst::mesh m = rst::read_mesh(argv[2]);
+            fit = get_fit_matrix(m.positions);
+            rst::mesh_buffers mesh = rst::load_mesh(r, std::move(m));
+            pos_id = mesh.positions;
+            ind_id = mesh.indices;
+            col_id = mesh.colors;
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << '\n';
+            return 1;
+        }
+    }
+
     int key = 0;
     int frame_count = 0;
 
     if (command_line)
     {
+        // The finished frame is written out on the frame consumer thread, straight from the frame buffer
+        r.set_frame_consumer([&](const rst::frame& f) {
+            cv::Mat image(f.height, f.width, CV_8UC4, (void*)f.data);
+            cv::imwrite(filename, image);
+        });
+
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
 
-        r.set_model(get_model_matrix(angle));
+        r.set_model(get_model_matrix(angle) * fit);
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
 
         r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
-
-        cv::imwrite(filename, image);
+        r.end_frame();
+        r.wait_frames();
 
         return 0;
     }
@@ -130,19 +179,23 @@ int main(int argc, const char** argv)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
 
-        r.set_model(get_model_matrix(angle));
+        r.set_model(get_model_matrix(angle) * fit);
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
 
         r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
+        r.end_frame();
 
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        cv::Mat image(700, 700, CV_8UC4, r.frame_buffer().data());
         cv::imshow("image", image);
         key = cv::waitKey(10);
 
         std::cout << "frame count: " << frame_count++ << '\n';
+        if (rst::stats_enabled)
+        {
+            rst::write_json(std::cout, r.stats());
+            std::cout << '\n';
+        }
     }
 
     return 0;
@@ -0,0 +1,104 @@
+//
+// Read-only memory mapping of a whole file.
+//
+
+#include "mapped_file.hpp"
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+rst::mapped_file::mapped_file(const std::string& filename)
+{
+    file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        file = nullptr;
+        throw std::runtime_error("Cannot open " + filename);
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+    {
+        CloseHandle(file);
+        throw std::runtime_error("Cannot read the size of " + filename);
+    }
+    length = (std::size_t)size.QuadPart;
+    if (length == 0)
+    {
+        return;
+    }
+
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    bytes = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (!bytes)
+    {
+        if (mapping)
+        {
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+        throw std::runtime_error("Cannot map " + filename);
+    }
+}
+
+rst::mapped_file::~mapped_file()
+{
+    if (bytes)
+    {
+        UnmapViewOfFile(bytes);
+    }
+    if (mapping)
+    {
+        CloseHandle(mapping);
+    }
+    if (file)
+    {
+        CloseHandle(file);
+    }
+}
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+rst::mapped_file::mapped_file(const std::string& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Cannot open " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Cannot read the size of " + filename);
+    }
+    length = (std::size_t)st.st_size;
+    if (length > 0)
+    {
+        void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Cannot map " + filename);
+        }
+        madvise(p, length, MADV_SEQUENTIAL);
+        bytes = (const char*)p;
+    }
+    // The mapping keeps the file alive on its own
+    close(fd);
+}
+
+rst::mapped_file::~mapped_file()
+{
+    if (bytes)
+    {
+        munmap((void*)bytes, length);
+    }
+}
+#endif
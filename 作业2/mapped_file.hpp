@@ -0,0 +1,38 @@
+//
+// Read-only memory mapping of a whole file.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace rst
+{
+    /*
+     * Maps a file into memory for reading, so a parser works on its bytes in place and the OS pages them
+     * in as they are touched instead of copying the file through a read buffer. The mapping lives as
+     * long as the object; an empty file maps to size() == 0.
+     * */
+    class mapped_file
+    {
+    public:
+        // Throws if the file cannot be opened or mapped
+        explicit mapped_file(const std::string& filename);
+        ~mapped_file();
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        const char* data() const { return bytes; }
+        std::size_t size() const { return length; }
+
+    private:
+        const char* bytes = nullptr;
+        std::size_t length = 0;
+#ifdef _WIN32
+        void* file = nullptr;
+        void* mapping = nullptr;
+#endif
+    };
+}
@@ -0,0 +1,834 @@
+//
+// OBJ and binary PLY mesh loading, parsed in place from a memory mapping of the file.
+//
+
+#include "mesh_loader.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include "mapped_file.hpp"
+#include "thread_pool.hpp"
+
+namespace
+{
+    // Files below this size are parsed on the calling thread
+    constexpr std::size_t parallel_size = 1 << 20;
+
+    // Offset marking a relative OBJ face index in obj_part::corners
+    constexpr long long relative_index = 1ll << 42;
+
+    bool isSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    bool isDigit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    // Colours are stored in 0..255 and Triangle::setColor rejects anything else; NaN becomes 0
+    float clampColor(float c)
+    {
+        return c > 0.0f ? std::min(c, 255.0f) : 0.0f;
+    }
+
+    Eigen::Vector3f clampColor(const Eigen::Vector3f& c)
+    {
+        return Eigen::Vector3f(clampColor(c.x()), clampColor(c.y()), clampColor(c.z()));
+    }
+
+    /*
+     * Reads a decimal number at p without allocating and without looking past end, which the strto*
+     * family cannot promise for a mapping that is not null terminated. Up to 19 significant digits with
+     * a power of ten that double holds exactly are converted with one correctly rounded operation;
+     * anything longer goes through strtod on a copy.
+     * */
+    bool parseFloat(const char*& p, const char* end, float& out)
+    {
+        static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+        const char* start = p;
+        const char* s = p;
+        bool negative = false;
+        if (s < end && (*s == '-' || *s == '+'))
+        {
+            negative = *s++ == '-';
+        }
+
+        std::uint64_t mantissa = 0;
+        int digits = 0, exponent = 0;
+        bool any = false;
+        for (; s < end && isDigit(*s); ++s, any = true)
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (*s - '0');
+                digits += mantissa != 0;
+            }
+            else
+            {
+                ++exponent;
+            }
+        }
+        if (s < end && *s == '.')
+        {
+            for (++s; s < end && isDigit(*s); ++s, any = true)
+            {
+                if (digits < 19)
+                {
+                    mantissa = mantissa * 10 + (*s - '0');
+                    digits += mantissa != 0;
+                    --exponent;
+                }
+            }
+        }
+        if (!any)
+        {
+            return false;
+        }
+        if (s < end && (*s == 'e' || *s == 'E'))
+        {
+            const char* e = s + 1;
+            bool e_negative = false;
+            if (e < end && (*e == '-' || *e == '+'))
+            {
+                e_negative = *e++ == '-';
+            }
+            if (e < end && isDigit(*e))
+            {
+                int value = 0;
+                for (; e < end && isDigit(*e); ++e)
+                {
+                    value = std::min(value * 10 + (*e - '0'), 100000);
+                }
+                exponent += e_negative ? -value : value;
+                s = e;
+            }
+        }
+        p = s;
+
+        if (mantissa < (1ull << 53) && exponent >= -22 && exponent <= 22)
+        {
+            double v = exponent < 0 ? (double)mantissa / powers[-exponent] : (double)mantissa * powers[exponent];
+            out = (float)(negative ? -v : v);
+            return true;
+        }
+        char buffer[64];
+        std::size_t length = (std::size_t)(s - start);
+        if (length < sizeof(buffer))
+        {
+            std::memcpy(buffer, start, length);
+            buffer[length] = 0;
+            out = (float)std::strtod(buffer, nullptr);
+        }
+        else
+        {
+            out = (float)std::strtod(std::string(start, s).c_str(), nullptr);
+        }
+        return true;
+    }
+
+    bool parseInt(const char*& p, const char* end, long long& out)
+    {
+        const char* s = p;
+        bool negative = false;
+        if (s < end && (*s == '-' || *s == '+'))
+        {
+            negative = *s++ == '-';
+        }
+        if (s == end || !isDigit(*s))
+        {
+            return false;
+        }
+        long long value = 0;
+        for (; s < end && isDigit(*s); ++s)
+        {
+            value = std::min(value * 10 + (*s - '0'), 1ll << 40);
+        }
+        out = negative ? -value : value;
+        p = s;
+        return true;
+    }
+
+    void skipSpace(const char*& p, const char* end)
+    {
+        while (p < end && isSpace(*p))
+        {
+            ++p;
+        }
+    }
+
+    const char* lineEnd(const char* p, const char* end)
+    {
+        const char* nl = (const char*)std::memchr(p, '\n', (std::size_t)(end - p));
+        return nl ? nl : end;
+    }
+
+    std::runtime_error lineError(const std::string& what, const char* line, const char* end)
+    {
+        std::string text(line, std::min(lineEnd(line, end), line + 80));
+        return std::runtime_error(what + ": \"" + text + "\"");
+    }
+
+    // Runs job(part) for parts 0..count-1, on a pool if there is one; the first exception is rethrown
+    template <class Job>
+    void forParts(rst::thread_pool* pool, int count, const Job& job)
+    {
+        if (!pool)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                job(i);
+            }
+            return;
+        }
+        std::vector<std::exception_ptr> errors(count);
+        pool->parallel_for(count, [&](int i, int) {
+            try
+            {
+                job(i);
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+            }
+        });
+        for (auto& e : errors)
+        {
+            if (e)
+            {
+                std::rethrow_exception(e);
+            }
+        }
+    }
+
+    std::unique_ptr<rst::thread_pool> makePool(const rst::mesh_options& options, std::size_t bytes)
+    {
+        int threads = options.threads;
+        if (threads <= 0)
+        {
+            threads = std::max(1, (int)std::thread::hardware_concurrency());
+        }
+        if (threads == 1 || bytes < parallel_size)
+        {
+            return nullptr;
+        }
+        return std::make_unique<rst::thread_pool>(threads);
+    }
+
+    /*
+     * What one part of an OBJ file holds. A face index is stored resolved where it can be: an absolute
+     * OBJ index n as n - 1, a relative one as l - relative_index with l the vertex it names counted from
+     * the start of the part (negative if it lies in an earlier part), which becomes absolute once the
+     * parts before it are counted.
+     * */
+    struct obj_part
+    {
+        std::vector<Eigen::Vector3f> positions;
+        std::vector<Eigen::Vector3f> colors;
+        std::vector<long long> corners;
+    };
+
+    void parseObjPart(const char* p, const char* end, obj_part& part)
+    {
+        long long polygon[3];
+        while (p < end)
+        {
+            const char* line = p;
+            const char* eol = lineEnd(p, end);
+            skipSpace(p, eol);
+            if (eol - p >= 2 && p[0] == 'v' && isSpace(p[1]))
+            {
+                p += 2;
+                float v[6];
+                int count = 0;
+                for (; count < 6; ++count)
+                {
+                    skipSpace(p, eol);
+                    if (!parseFloat(p, eol, v[count]))
+                    {
+                        break;
+                    }
+                }
+                if (count < 3)
+                {
+                    throw lineError("Malformed vertex", line, end);
+                }
+                part.positions.emplace_back(v[0], v[1], v[2]);
+                part.colors.push_back(count == 6 ? clampColor(Eigen::Vector3f(v[3], v[4], v[5]) * 255)
+                                                 : Eigen::Vector3f(255, 255, 255));
+            }
+            else if (eol - p >= 2 && p[0] == 'f' && isSpace(p[1]))
+            {
+                p += 2;
+                int count = 0;
+                long long local = (long long)part.positions.size();
+                for (;;)
+                {
+                    skipSpace(p, eol);
+                    long long index;
+                    if (p == eol || !parseInt(p, eol, index))
+                    {
+                        break;
+                    }
+                    // Texture and normal indices after the slashes are not used
+                    while (p < eol && !isSpace(*p))
+                    {
+                        ++p;
+                    }
+                    if (index == 0)
+                    {
+                        throw lineError("Face with an invalid vertex index", line, end);
+                    }
+                    long long corner = index > 0 ? index - 1 : local + index - relative_index;
+                    if (count < 2)
+                    {
+                        polygon[count] = corner;
+                    }
+                    else
+                    {
+                        polygon[2] = corner;
+                        part.corners.insert(part.corners.end(), polygon, polygon + 3);
+                        polygon[1] = corner;
+                    }
+                    ++count;
+                }
+                if (count < 3)
+                {
+                    throw lineError("Face with less than three vertices", line, end);
+                }
+            }
+            p = eol < end ? eol + 1 : end;
+        }
+    }
+
+    rst::mesh readObj(const char* data, std::size_t size, const rst::mesh_options& options)
+    {
+        const char* end = data + size;
+        auto pool = makePool(options, size);
+
+        // Parts start right after a line break, so no line is split between two of them
+        int part_count = pool ? pool->size() * 4 : 1;
+        std::vector<const char*> bounds{data};
+        for (int i = 1; i < part_count; ++i)
+        {
+            const char* p = std::max(data + size * i / part_count, bounds.back());
+            p = p < end ? lineEnd(p, end) : end;
+            bounds.push_back(p < end ? p + 1 : end);
+        }
+        bounds.push_back(end);
+
+        std::vector<obj_part> parts(part_count);
+        forParts(pool.get(), part_count, [&](int i) { parseObjPart(bounds[i], bounds[i + 1], parts[i]); });
+
+        std::vector<std::size_t> first_vertex(part_count + 1, 0), first_corner(part_count + 1, 0);
+        for (int i = 0; i < part_count; ++i)
+        {
+            first_vertex[i + 1] = first_vertex[i] + parts[i].positions.size();
+            first_corner[i + 1] = first_corner[i] + parts[i].corners.size();
+        }
+        long long vertex_count = (long long)first_vertex[part_count];
+
+        rst::mesh m;
+        m.positions.resize(vertex_count);
+        m.colors.resize(vertex_count);
+        m.indices.resize(first_corner[part_count] / 3);
+        forParts(pool.get(), part_count, [&](int i) {
+            obj_part& part = parts[i];
+            std::copy(part.positions.begin(), part.positions.end(), m.positions.begin() + first_vertex[i]);
+            std::copy(part.colors.begin(), part.colors.end(), m.colors.begin() + first_vertex[i]);
+            int* out = m.indices.empty() ? nullptr : m.indices[0].data() + first_corner[i];
+            for (long long c : part.corners)
+            {
+                long long index = c >= 0 ? c : (long long)first_vertex[i] + c + relative_index;
+                if (index < 0 || index >= vertex_count)
+                {
+                    throw std::runtime_error("Face refers to vertex " + std::to_string(index + 1) + " of " + std::to_string(vertex_count));
+                }
+                *out++ = (int)index;
+            }
+            std::vector<long long>().swap(part.corners);
+        });
+        return m;
+    }
+
+    enum class ply_type
+    {
+        Int8,
+        UInt8,
+        Int16,
+        UInt16,
+        Int32,
+        UInt32,
+        Float32,
+        Float64
+    };
+
+    int typeSize(ply_type t)
+    {
+        static const int sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+        return sizes[(int)t];
+    }
+
+    ply_type typeNamed(const std::string& name)
+    {
+        static const char* names[][2] = {{"char", "int8"},   {"uchar", "uint8"}, {"short", "int16"},   {"ushort", "uint16"},
+                                         {"int", "int32"},   {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}};
+        for (int i = 0; i < 8; ++i)
+        {
+            if (name == names[i][0] || name == names[i][1])
+            {
+                return (ply_type)i;
+            }
+        }
+        throw std::runtime_error("Unknown PLY property type " + name);
+    }
+
+    double readValue(const char* p, ply_type t, bool swap)
+    {
+        unsigned char b[8];
+        int size = typeSize(t);
+        std::memcpy(b, p, size);
+        if (swap)
+        {
+            std::reverse(b, b + size);
+        }
+        switch (t)
+        {
+        case ply_type::Int8: { std::int8_t v; std::memcpy(&v, b, 1); return v; }
+        case ply_type::UInt8: return b[0];
+        case ply_type::Int16: { std::int16_t v; std::memcpy(&v, b, 2); return v; }
+        case ply_type::UInt16: { std::uint16_t v; std::memcpy(&v, b, 2); return v; }
+        case ply_type::Int32: { std::int32_t v; std::memcpy(&v, b, 4); return v; }
+        case ply_type::UInt32: { std::uint32_t v; std::memcpy(&v, b, 4); return v; }
+        case ply_type::Float32: { float v; std::memcpy(&v, b, 4); return v; }
+        default: { double v; std::memcpy(&v, b, 8); return v; }
+        }
+    }
+
+    // Factor taking a colour channel of type t to 0..255: floating point channels are in 0..1, integer
+    // ones span the full range of their type
+    float colorScale(ply_type t)
+    {
+        switch (t)
+        {
+        case ply_type::Int16:
+        case ply_type::UInt16: return 255.0f / 65535.0f;
+        case ply_type::Int32:
+        case ply_type::UInt32: return (float)(255.0 / 4294967295.0);
+        case ply_type::Float32:
+        case ply_type::Float64: return 255.0f;
+        default: return 1.0f;
+        }
+    }
+
+    struct ply_property
+    {
+        std::string name;
+        ply_type type;
+        bool list;
+        ply_type count_type;
+    };
+
+    struct ply_element
+    {
+        std::string name;
+        std::size_t count;
+        std::vector<ply_property> properties;
+
+        // Bytes per row, -1 if a list makes it vary
+        int stride() const
+        {
+            int size = 0;
+            for (auto& p : properties)
+            {
+                if (p.list)
+                {
+                    return -1;
+                }
+                size += typeSize(p.type);
+            }
+            return size;
+        }
+    };
+
+    std::string nextWord(const char*& p, const char* end)
+    {
+        skipSpace(p, end);
+        const char* s = p;
+        while (p < end && !isSpace(*p) && *p != '\n')
+        {
+            ++p;
+        }
+        return std::string(s, p);
+    }
+
+    // Bytes of one row of e at p, which must lie before end
+    std::size_t rowSize(const ply_element& e, const char* p, const char* end, bool swap)
+    {
+        const char* s = p;
+        for (auto& prop : e.properties)
+        {
+            std::ptrdiff_t size = typeSize(prop.list ? prop.count_type : prop.type);
+            if (end - p < size)
+            {
+                throw std::runtime_error("PLY file ends inside element " + e.name);
+            }
+            if (prop.list)
+            {
+                // The count is checked as a double, before a negative or huge one can wrap around in size_t
+                double n = readValue(p, prop.count_type, swap);
+                p += size;
+                if (!(n >= 0) || n * typeSize(prop.type) > (double)(end - p))
+                {
+                    throw std::runtime_error("PLY element " + e.name +
+                                             " has a list count that is negative or runs past the file");
+                }
+                size = (std::ptrdiff_t)n * typeSize(prop.type);
+            }
+            p += size;
+        }
+        return (std::size_t)(p - s);
+    }
+
+    void readPlyVertices(const ply_element& e, const char* p, bool swap, rst::thread_pool* pool, rst::mesh& m)
+    {
+        int stride = e.stride();
+        if (stride < 0)
+        {
+            throw std::runtime_error("PLY vertices with list properties are not supported");
+        }
+        int offset[6] = {-1, -1, -1, -1, -1, -1};
+        ply_type type[6] = {};
+        static const char* names[6] = {"x", "y", "z", "red", "green", "blue"};
+        int at = 0;
+        for (auto& prop : e.properties)
+        {
+            for (int k = 0; k < 6; ++k)
+            {
+                if (prop.name == names[k])
+                {
+                    offset[k] = at;
+                    type[k] = prop.type;
+                }
+            }
+            at += typeSize(prop.type);
+        }
+        if (offset[0] < 0 || offset[1] < 0 || offset[2] < 0)
+        {
+            throw std::runtime_error("PLY vertices need x, y and z");
+        }
+        bool has_color = offset[3] >= 0 && offset[4] >= 0 && offset[5] >= 0;
+        Eigen::Vector3f color_scale = has_color ? Eigen::Vector3f(colorScale(type[3]), colorScale(type[4]), colorScale(type[5]))
+                                                : Eigen::Vector3f::Ones();
+
+        m.positions.resize(e.count);
+        m.colors.resize(e.count);
+        int part_count = pool ? pool->size() * 4 : 1;
+        forParts(pool, part_count, [&](int part) {
+            std::size_t first = e.count * part / part_count, last = e.count * (part + 1) / part_count;
+            for (std::size_t i = first; i < last; ++i)
+            {
+                const char* row = p + i * stride;
+                m.positions[i] = Eigen::Vector3f((float)readValue(row + offset[0], type[0], swap),
+                                                 (float)readValue(row + offset[1], type[1], swap),
+                                                 (float)readValue(row + offset[2], type[2], swap));
+                m.colors[i] = has_color ? clampColor(Eigen::Vector3f((float)readValue(row + offset[3], type[3], swap),
+                                                                     (float)readValue(row + offset[4], type[4], swap),
+                                                                     (float)readValue(row + offset[5], type[5], swap))
+                                                         .cwiseProduct(color_scale))
+                                        : Eigen::Vector3f(255, 255, 255);
+            }
+        });
+    }
+
+    // Faces as triangle fans; returns the end of the element
+    const char* readPlyFaces(const ply_element& e, const char* p, const char* end, bool swap, rst::thread_pool* pool, rst::mesh& m)
+    {
+        int list = -1;
+        for (int k = 0; k < (int)e.properties.size(); ++k)
+        {
+            if (e.properties[k].list && (e.properties[k].name == "vertex_indices" || e.properties[k].name == "vertex_index"))
+            {
+                list = k;
+            }
+        }
+        if (list < 0)
+        {
+            throw std::runtime_error("PLY faces need a vertex_indices list");
+        }
+        const ply_property& prop = e.properties[list];
+        int count_size = typeSize(prop.count_type), index_size = typeSize(prop.type);
+
+        // Files of nothing but triangles have rows of one size, which splits them into parts for free
+        if (e.properties.size() == 1)
+        {
+            std::size_t stride = count_size + 3 * (std::size_t)index_size;
+            if ((std::size_t)(end - p) >= stride * e.count)
+            {
+                m.indices.resize(e.count);
+                std::atomic<bool> triangles{true};
+                int part_count = pool ? pool->size() * 4 : 1;
+                forParts(pool, part_count, [&](int part) {
+                    std::size_t first = e.count * part / part_count, last = e.count * (part + 1) / part_count;
+                    for (std::size_t i = first; i < last && triangles; ++i)
+                    {
+                        const char* row = p + i * stride;
+                        if (readValue(row, prop.count_type, swap) != 3)
+                        {
+                            triangles = false;
+                            break;
+                        }
+                        for (int k = 0; k < 3; ++k)
+                        {
+                            m.indices[i][k] = (int)readValue(row + count_size + k * index_size, prop.type, swap);
+                        }
+                    }
+                });
+                if (triangles)
+                {
+                    return p + stride * e.count;
+                }
+                m.indices.clear();
+            }
+        }
+
+        for (std::size_t i = 0; i < e.count; ++i)
+        {
+            for (int k = 0; k < (int)e.properties.size(); ++k)
+            {
+                const ply_property& q = e.properties[k];
+                if (k != list)
+                {
+                    ply_element single{e.name, 1, {q}};
+                    p += rowSize(single, p, end, swap);
+                    continue;
+                }
+                if (end - p < count_size)
+                {
+                    throw std::runtime_error("PLY file ends inside the faces");
+                }
+                double count = readValue(p, q.count_type, swap);
+                p += count_size;
+                if (!(count >= 3) || count * index_size > (double)(end - p))
+                {
+                    throw std::runtime_error("PLY face " + std::to_string(i) + " is malformed");
+                }
+                int n = (int)count;
+                int first = (int)readValue(p, q.type, swap);
+                for (int c = 2; c < n; ++c)
+                {
+                    m.indices.emplace_back(first, (int)readValue(p + (c - 1) * index_size, q.type, swap),
+                                           (int)readValue(p + c * index_size, q.type, swap));
+                }
+                p += (std::size_t)n * index_size;
+            }
+        }
+        return p;
+    }
+
+    rst::mesh readPly(const char* data, std::size_t size, const rst::mesh_options& options)
+    {
+        const char* end = data + size;
+        const char* p = data;
+        std::vector<ply_element> elements;
+        bool swap = false;
+        bool header_done = false;
+        int line_number = 0;
+        while (p < end && !header_done)
+        {
+            const char* line = p;
+            const char* eol = lineEnd(p, end);
+            std::string word = nextWord(p, eol);
+            if (line_number++ == 0 && word != "ply")
+            {
+                throw std::runtime_error("Not a PLY file");
+            }
+            if (word == "format")
+            {
+                std::string format = nextWord(p, eol);
+                if (format == "ascii")
+                {
+                    throw std::runtime_error("ASCII PLY files are not supported, only binary ones");
+                }
+                if (format != "binary_little_endian" && format != "binary_big_endian")
+                {
+                    throw lineError("Unknown PLY format", line, end);
+                }
+                const std::uint16_t one = 1;
+                bool little = *(const unsigned char*)&one == 1;
+                swap = (format == "binary_little_endian") != little;
+            }
+            else if (word == "element")
+            {
+                std::string name = nextWord(p, eol);
+                long long count;
+                skipSpace(p, eol);
+                if (!parseInt(p, eol, count) || count < 0)
+                {
+                    throw lineError("Malformed PLY element", line, end);
+                }
+                elements.push_back({name, (std::size_t)count, {}});
+            }
+            else if (word == "property")
+            {
+                if (elements.empty())
+                {
+                    throw lineError("PLY property outside an element", line, end);
+                }
+                std::string type = nextWord(p, eol);
+                ply_property prop{};
+                if (type == "list")
+                {
+                    prop.list = true;
+                    prop.count_type = typeNamed(nextWord(p, eol));
+                    prop.type = typeNamed(nextWord(p, eol));
+                }
+                else
+                {
+                    prop.type = typeNamed(type);
+                }
+                prop.name = nextWord(p, eol);
+                elements.back().properties.push_back(prop);
+            }
+            else if (word == "end_header")
+            {
+                header_done = true;
+            }
+            p = eol < end ? eol + 1 : end;
+        }
+        if (!header_done)
+        {
+            throw std::runtime_error("PLY header has no end");
+        }
+
+        auto pool = makePool(options, size);
+        rst::mesh m;
+        p = std::min(p, end);
+        for (auto& e : elements)
+        {
+            if (e.name == "vertex")
+            {
+                int stride = e.stride();
+                if (stride > 0 && (std::size_t)(end - p) < (std::size_t)stride * e.count)
+                {
+                    throw std::runtime_error("PLY file ends inside the vertices");
+                }
+                readPlyVertices(e, p, swap, pool.get(), m);
+                p += (std::size_t)stride * e.count;
+            }
+            else if (e.name == "face")
+            {
+                p = readPlyFaces(e, p, end, swap, pool.get(), m);
+            }
+            else
+            {
+                for (std::size_t i = 0; i < e.count; ++i)
+                {
+                    p += rowSize(e, p, end, swap);
+                }
+            }
+        }
+
+        long long vertex_count = (long long)m.positions.size();
+        for (auto& t : m.indices)
+        {
+            for (int k = 0; k < 3; ++k)
+            {
+                if (t[k] < 0 || t[k] >= vertex_count)
+                {
+                    throw std::runtime_error("Face refers to vertex " + std::to_string(t[k]) + " of " + std::to_string(vertex_count));
+                }
+            }
+        }
+        return m;
+    }
+
+    // Bit pattern of a vertex, so that only exactly equal vertices are merged
+    struct vertex_key
+    {
+        std::uint32_t bits[6];
+
+        bool operator==(const vertex_key& o) const
+        {
+            return std::memcmp(bits, o.bits, sizeof(bits)) == 0;
+        }
+    };
+
+    struct vertex_hash
+    {
+        std::size_t operator()(const vertex_key& k) const
+        {
+            std::uint64_t h = 1469598103934665603ull;
+            for (std::uint32_t b : k.bits)
+            {
+                h = (h ^ b) * 1099511628211ull;
+            }
+            return (std::size_t)(h ^ (h >> 32));
+        }
+    };
+
+    void deduplicate(rst::mesh& m)
+    {
+        std::unordered_map<vertex_key, int, vertex_hash> first;
+        first.reserve(m.positions.size());
+        std::vector<int> remap(m.positions.size());
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < m.positions.size(); ++i)
+        {
+            vertex_key key;
+            std::memcpy(key.bits, m.positions[i].data(), 12);
+            std::memcpy(key.bits + 3, m.colors[i].data(), 12);
+            auto found = first.emplace(key, (int)kept);
+            if (found.second)
+            {
+                m.positions[kept] = m.positions[i];
+                m.colors[kept] = m.colors[i];
+                ++kept;
+            }
+            remap[i] = found.first->second;
+        }
+        if (kept == m.positions.size())
+        {
+            return;
+        }
+        m.positions.resize(kept);
+        m.colors.resize(kept);
+        for (auto& t : m.indices)
+        {
+            t = Eigen::Vector3i(remap[t[0]], remap[t[1]], remap[t[2]]);
+        }
+    }
+}
+
+rst::mesh rst::read_mesh(const std::string& filename, const mesh_options& options)
+{
+    mapped_file file(filename);
+    std::string extension = filename.substr(std::min(filename.size(), filename.rfind('.')));
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return (char)std::tolower((unsigned char)c); });
+
+    mesh m = extension == ".obj" ? readObj(file.data(), file.size(), options) : readPly(file.data(), file.size(), options);
+    if (options.deduplicate)
+    {
+        deduplicate(m);
+    }
+    return m;
+}
+
+rst::mesh_buffers rst::load_mesh(rasterizer& r, mesh&& m)
+{
+    mesh_buffers ids;
+    ids.positions = r.load_positions(std::move(m.positions));
+    ids.indices = r.load_indices(std::move(m.indices));
+    ids.colors = r.load_colors(std::move(m.colors));
+    return ids;
+}
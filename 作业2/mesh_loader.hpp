@@ -0,0 +1,50 @@
+//
+// OBJ and binary PLY mesh loading, parsed in place from a memory mapping of the file.
+//
+
+#pragma once
+
+#include <Eigen/Eigen>
+#include <string>
+#include <vector>
+#include "rasterizer.hpp"
+
+namespace rst
+{
+    // Vertex colours are in 0..255 like those handed to load_colors; vertices without one are white
+    struct mesh
+    {
+        std::vector<Eigen::Vector3f> positions;
+        std::vector<Eigen::Vector3f> colors;
+        std::vector<Eigen::Vector3i> indices;
+    };
+
+    struct mesh_options
+    {
+        // Threads parsing the file: 0 picks one per hardware thread. Small files use one.
+        int threads = 0;
+        // Merge vertices whose position and colour are exactly equal, as in files that store every
+        // triangle with its own three vertices
+        bool deduplicate = true;
+    };
+
+    /*
+     * Reads a Wavefront OBJ (by its .obj extension) or a binary PLY file. OBJ files give their `v` lines,
+     * optionally followed by an RGB colour in 0..1, and `f` lines with positive or relative indices;
+     * everything else (texture coordinates, normals, groups, materials) is skipped. PLY files give the
+     * x, y, z and optional red, green, blue properties of their vertex element and the vertex_indices
+     * lists of their face element. Polygons are split into triangle fans. Throws on malformed files and
+     * on faces that refer to vertices the file does not have.
+     * */
+    mesh read_mesh(const std::string& filename, const mesh_options& options = mesh_options());
+
+    struct mesh_buffers
+    {
+        pos_buf_id positions;
+        ind_buf_id indices;
+        col_buf_id colors;
+    };
+
+    // Hands the arrays of a mesh over to the rasterizer without copying them
+    mesh_buffers load_mesh(rasterizer& r, mesh&& m);
+}
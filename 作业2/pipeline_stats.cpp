@@ -0,0 +1,110 @@
+//
+// Per frame counters and stage timings of the rasterizer, with JSON and Chrome trace export.
+//
+
+#include "pipeline_stats.hpp"
+#include <utility>
+
+thread_local rst::pipeline_counters* rst::thread_counters = nullptr;
+
+const char* rst::stage_name(pipeline_stage stage)
+{
+    static const char* names[pipeline_stage_count] = {"clear", "vertex", "assembly", "binning", "raster", "resolve"};
+    return names[(int)stage];
+}
+
+void rst::pipeline_counters::add(const pipeline_counters& other)
+{
+    draws += other.draws;
+    clears += other.clears;
+    vertices += other.vertices;
+    triangles += other.triangles;
+    triangles_outside += other.triangles_outside;
+    triangles_clipped += other.triangles_clipped;
+    triangles_culled += other.triangles_culled;
+    triangles_rasterized += other.triangles_rasterized;
+    tile_triangles += other.tile_triangles;
+    tile_rejects += other.tile_rejects;
+    pixels_tested += other.pixels_tested;
+    pixels_covered += other.pixels_covered;
+    depth_passed += other.depth_passed;
+    pixel_writes += other.pixel_writes;
+}
+
+rst::stage_timer::stage_timer(frame_stats& stats, pipeline_stage stage, std::chrono::steady_clock::time_point epoch)
+    : stats(stats), stage(stage), epoch(epoch), start(std::chrono::steady_clock::now())
+{
+}
+
+rst::stage_timer::~stage_timer()
+{
+    auto end = std::chrono::steady_clock::now();
+    double us = std::chrono::duration<double, std::micro>(end - start).count();
+    stats.stage_ms[(int)stage] += us * 1e-3;
+    stats.events.push_back({stage, std::chrono::duration<double, std::micro>(start - epoch).count(), us});
+}
+
+// Name and value of every counter, depth_failed included, as JSON members
+static void writeCounters(std::ostream& out, const rst::pipeline_counters& c)
+{
+    const std::pair<const char*, std::uint64_t> fields[] = {
+        {"draws", c.draws},
+        {"clears", c.clears},
+        {"vertices", c.vertices},
+        {"triangles", c.triangles},
+        {"triangles_outside", c.triangles_outside},
+        {"triangles_clipped", c.triangles_clipped},
+        {"triangles_culled", c.triangles_culled},
+        {"triangles_rasterized", c.triangles_rasterized},
+        {"tile_triangles", c.tile_triangles},
+        {"tile_rejects", c.tile_rejects},
+        {"pixels_tested", c.pixels_tested},
+        {"pixels_covered", c.pixels_covered},
+        {"depth_passed", c.depth_passed},
+        {"depth_failed", c.depth_failed()},
+        {"pixel_writes", c.pixel_writes},
+    };
+    bool first = true;
+    for (auto& f : fields)
+    {
+        out << (first ? "" : ", ") << '"' << f.first << "\": " << f.second;
+        first = false;
+    }
+}
+
+void rst::write_json(std::ostream& out, const frame_stats& stats)
+{
+    out << "{\"frame\": " << stats.frame << ", \"frame_ms\": " << stats.frame_ms << ", \"stage_ms\": {";
+    for (int i = 0; i < pipeline_stage_count; ++i)
+    {
+        out << (i ? ", " : "") << '"' << stage_name((pipeline_stage)i) << "\": " << stats.stage_ms[i];
+    }
+    out << "}, \"counters\": {";
+    writeCounters(out, stats.counters);
+    out << "}}";
+}
+
+void rst::write_chrome_trace(std::ostream& out, const std::vector<frame_stats>& frames)
+{
+    out << "{\"traceEvents\": [\n";
+    bool first = true;
+    auto event = [&]() -> std::ostream& {
+        out << (first ? "  " : ",\n  ");
+        first = false;
+        return out;
+    };
+    for (const frame_stats& f : frames)
+    {
+        event() << "{\"name\": \"frame " << f.frame << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": "
+                << f.start_us << ", \"dur\": " << f.frame_ms * 1e3 << "}";
+        for (const stage_event& e : f.events)
+        {
+            event() << "{\"name\": \"" << stage_name(e.stage) << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": 2, \"ts\": "
+                    << e.start_us << ", \"dur\": " << e.duration_us << "}";
+        }
+        event() << "{\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << f.start_us << ", \"args\": {";
+        writeCounters(out, f.counters);
+        out << "}}";
+    }
+    out << "\n]}\n";
+}
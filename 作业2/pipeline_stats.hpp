@@ -0,0 +1,135 @@
+//
+// Per frame counters and stage timings of the rasterizer, with JSON and Chrome trace export.
+//
+// Counting costs time in the pixel loops, so it is only compiled in when the whole build defines
+// RST_STATS=1 (a preprocessor definition of the project). Otherwise every RST_STAT statement vanishes
+// and rasterizer::stats() stays zero.
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#ifndef RST_STATS
+#define RST_STATS 0
+#endif
+
+#if RST_STATS
+#define RST_STAT(...) __VA_ARGS__
+#else
+#define RST_STAT(...)
+#endif
+
+namespace rst
+{
+    constexpr bool stats_enabled = RST_STATS != 0;
+
+    enum class pipeline_stage
+    {
+        Clear,
+        Vertex,
+        Assembly,
+        Binning,
+        Raster,
+        Resolve
+    };
+
+    constexpr int pipeline_stage_count = 6;
+
+    const char* stage_name(pipeline_stage stage);
+
+    /*
+     * Work done in a frame. Triangles count those of the index buffers, except rasterized, which counts
+     * the screen space triangles left after culling and clipping (a clipped triangle may become several).
+     * The pixel counters count samples: with MSAA every pixel has several.
+     * */
+    struct pipeline_counters
+    {
+        std::uint64_t draws = 0;
+        std::uint64_t clears = 0;
+        std::uint64_t vertices = 0;
+        std::uint64_t triangles = 0;
+        // All three vertices outside the same plane of the view volume
+        std::uint64_t triangles_outside = 0;
+        // Cut at the guard band or the near plane
+        std::uint64_t triangles_clipped = 0;
+        // Back facing, degenerate, between the samples or off screen
+        std::uint64_t triangles_culled = 0;
+        std::uint64_t triangles_rasterized = 0;
+        // Triangles binned into a tile, one per tile, and those the tile's depth range rejected whole
+        std::uint64_t tile_triangles = 0;
+        std::uint64_t tile_rejects = 0;
+        // Samples of the bounding boxes, those inside the triangle and those passing the depth test
+        std::uint64_t pixels_tested = 0;
+        std::uint64_t pixels_covered = 0;
+        std::uint64_t depth_passed = 0;
+        // set_pixel calls, lines included
+        std::uint64_t pixel_writes = 0;
+
+        std::uint64_t depth_failed() const { return pixels_covered - depth_passed; }
+        void add(const pipeline_counters& other);
+    };
+
+    // One run of a stage, in microseconds since the rasterizer was made
+    struct stage_event
+    {
+        pipeline_stage stage;
+        double start_us;
+        double duration_us;
+    };
+
+    struct frame_stats
+    {
+        // Frames finished before this one
+        std::uint64_t frame = 0;
+        double start_us = 0;
+        // From the first clear or draw to the end of end_frame's resolve
+        double frame_ms = 0;
+        // Summed over the draw calls of the frame
+        double stage_ms[pipeline_stage_count] = {};
+        pipeline_counters counters;
+        std::vector<stage_event> events;
+    };
+
+    // Adds the time until it goes out of scope to stage of stats
+    class stage_timer
+    {
+    public:
+        stage_timer(frame_stats& stats, pipeline_stage stage, std::chrono::steady_clock::time_point epoch);
+        ~stage_timer();
+        stage_timer(const stage_timer&) = delete;
+        stage_timer& operator=(const stage_timer&) = delete;
+
+    private:
+        frame_stats& stats;
+        pipeline_stage stage;
+        std::chrono::steady_clock::time_point epoch, start;
+    };
+
+    /*
+     * Counters of the work the calling thread is doing for a rasterizer, for the pixel loops that do not
+     * know which rasterizer or thread they run for. Every tile job points it at its own block, which the
+     * rasterizer sums when the frame ends; outside of tile jobs it is null.
+     * */
+    extern thread_local pipeline_counters* thread_counters;
+
+    inline int count_bits(unsigned mask)
+    {
+        int n = 0;
+        for (; mask; mask &= mask - 1)
+        {
+            ++n;
+        }
+        return n;
+    }
+
+    // The frame as one JSON object
+    void write_json(std::ostream& out, const frame_stats& stats);
+
+    // Frames in the Chrome trace event format (chrome://tracing, Perfetto): a span per stage run and
+    // per frame, and the counters of every frame as counter tracks
+    void write_chrome_trace(std::ostream& out, const std::vector<frame_stats>& frames);
+}
@@ -0,0 +1,187 @@
+//
+// Native framebuffer pixel formats and conversion from the rasterizer's colours.
+//
+
+#include "pixel_format.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static inline std::uint8_t toByte(float v)
+{
+    return (std::uint8_t)std::lround(std::min(255.0f, std::max(0.0f, v)));
+}
+
+int rst::bytes_per_pixel(pixel_format format)
+{
+    switch (format)
+    {
+    case pixel_format::RGBA8:
+    case pixel_format::BGRA8:
+        return 4;
+    case pixel_format::RGBA16F:
+        return 8;
+    case pixel_format::RGB32F:
+        return 12;
+    case pixel_format::RGBA32F:
+        return 16;
+    }
+    return 0;
+}
+
+void rst::encode_pixel(pixel_format format, const Eigen::Vector3f& color, void* dst)
+{
+    switch (format)
+    {
+    case pixel_format::RGB32F:
+    {
+        float v[3] = {color.x(), color.y(), color.z()};
+        std::memcpy(dst, v, sizeof(v));
+        break;
+    }
+    case pixel_format::RGBA8:
+    {
+        std::uint8_t v[4] = {toByte(color.x()), toByte(color.y()), toByte(color.z()), 255};
+        std::memcpy(dst, v, sizeof(v));
+        break;
+    }
+    case pixel_format::BGRA8:
+    {
+        std::uint8_t v[4] = {toByte(color.z()), toByte(color.y()), toByte(color.x()), 255};
+        std::memcpy(dst, v, sizeof(v));
+        break;
+    }
+    case pixel_format::RGBA16F:
+    {
+        std::uint16_t v[4] = {float_to_half(color.x() / 255.0f), float_to_half(color.y() / 255.0f),
+                              float_to_half(color.z() / 255.0f), float_to_half(1.0f)};
+        std::memcpy(dst, v, sizeof(v));
+        break;
+    }
+    case pixel_format::RGBA32F:
+    {
+        float v[4] = {color.x() / 255.0f, color.y() / 255.0f, color.z() / 255.0f, 1.0f};
+        std::memcpy(dst, v, sizeof(v));
+        break;
+    }
+    }
+}
+
+Eigen::Vector3f rst::decode_pixel(pixel_format format, const void* src)
+{
+    switch (format)
+    {
+    case pixel_format::RGB32F:
+    {
+        float v[3];
+        std::memcpy(v, src, sizeof(v));
+        return {v[0], v[1], v[2]};
+    }
+    case pixel_format::RGBA8:
+    {
+        const std::uint8_t* v = (const std::uint8_t*)src;
+        return {(float)v[0], (float)v[1], (float)v[2]};
+    }
+    case pixel_format::BGRA8:
+    {
+        const std::uint8_t* v = (const std::uint8_t*)src;
+        return {(float)v[2], (float)v[1], (float)v[0]};
+    }
+    case pixel_format::RGBA16F:
+    {
+        std::uint16_t v[4];
+        std::memcpy(v, src, sizeof(v));
+        return Eigen::Vector3f(half_to_float(v[0]), half_to_float(v[1]), half_to_float(v[2])) * 255.0f;
+    }
+    case pixel_format::RGBA32F:
+    {
+        float v[4];
+        std::memcpy(v, src, sizeof(v));
+        return Eigen::Vector3f(v[0], v[1], v[2]) * 255.0f;
+    }
+    }
+    return {0, 0, 0};
+}
+
+// IEEE 754 binary16 conversion with round-to-nearest-even, overflow to infinity and denormals
+std::uint16_t rst::float_to_half(float f)
+{
+    std::uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    std::uint16_t sign = (std::uint16_t)((bits >> 16) & 0x8000);
+    std::uint32_t abs = bits & 0x7fffffff;
+
+    if (abs >= 0x7f800000)
+    {
+        // Inf stays Inf, NaN stays a (quiet) NaN
+        return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+    }
+    if (abs >= 0x477ff000)
+    {
+        // Rounds to a value beyond the largest half
+        return sign | 0x7c00;
+    }
+    if (abs < 0x38800000)
+    {
+        // Denormal half (or zero): shift the mantissa, with its implicit bit, into place
+        if (abs < 0x33000000)
+        {
+            return sign;
+        }
+        std::uint32_t exponent = abs >> 23;
+        std::uint32_t mantissa = (abs & 0x7fffff) | 0x800000;
+        std::uint32_t shift = 126 - exponent;
+        std::uint32_t half = mantissa >> shift;
+        std::uint32_t rest = mantissa & ((1u << shift) - 1);
+        std::uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+        {
+            ++half;
+        }
+        return sign | (std::uint16_t)half;
+    }
+
+    std::uint32_t half = ((abs - 0x38000000) >> 13);
+    std::uint32_t rest = abs & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+    {
+        ++half;
+    }
+    return sign | (std::uint16_t)half;
+}
+
+float rst::half_to_float(std::uint16_t h)
+{
+    std::uint32_t sign = (std::uint32_t)(h & 0x8000) << 16;
+    std::uint32_t exponent = (h >> 10) & 0x1f;
+    std::uint32_t mantissa = h & 0x3ff;
+    std::uint32_t bits;
+
+    if (exponent == 0x1f)
+    {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    }
+    else if (exponent != 0)
+    {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    else if (mantissa == 0)
+    {
+        bits = sign;
+    }
+    else
+    {
+        // Denormal half: normalise it
+        exponent = 113;
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            --exponent;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
@@ -0,0 +1,38 @@
+//
+// Native framebuffer pixel formats and conversion from the rasterizer's colours.
+//
+
+#pragma once
+
+#include <Eigen/Eigen>
+#include <cstdint>
+
+namespace rst
+{
+    /*
+     * Colours in the pipeline are RGB floats in 0..255. RGB32F stores them as they are (the original
+     * frame buffer), the 8-bit formats round them to bytes, and the RGBA16F/RGBA32F formats store them
+     * normalised to 0..1 without clamping so HDR values survive. Alpha is always opaque.
+     * RGBA8 and BGRA8 have the byte order their name spells, so BGRA8 can be handed to OpenCV (CV_8UC4)
+     * and RGBA8 to most encoders without conversion.
+     * */
+    enum class pixel_format
+    {
+        RGB32F,
+        RGBA8,
+        BGRA8,
+        RGBA16F,
+        RGBA32F
+    };
+
+    int bytes_per_pixel(pixel_format format);
+
+    // Writes one pixel of the given format to dst, which must hold bytes_per_pixel(format) bytes
+    void encode_pixel(pixel_format format, const Eigen::Vector3f& color, void* dst);
+
+    // Inverse of encode_pixel, back to RGB in 0..255
+    Eigen::Vector3f decode_pixel(pixel_format format, const void* src);
+
+    std::uint16_t float_to_half(float f);
+    float half_to_float(std::uint16_t h);
+}
@@ -0,0 +1,311 @@
+//
+// Row traversal for triangles that are not drawn by the constant colour span kernels: coverage and depth
+// per sample, colour from a shade functor called once per pixel.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "span_kernels.hpp"
+#include "pixel_format.hpp"
+#include "blending.hpp"
+#include "pipeline_stats.hpp"
+
+namespace rst
+{
+    // Blend mode and alpha of a translucent draw, whose alpha multiplies that of its fragments.
+    // depth_shift brings the depths into 0..1 for the weights of the order-independent mode.
+    struct blend_state
+    {
+        blend_mode mode;
+        float alpha;
+        float depth_shift;
+    };
+
+    // Depth and colour memory of the render target; rows run from top to bottom and the samples of a
+    // pixel are stored next to each other. The depth rows may be a copy of those of one tile, whose
+    // first row is row depth_top of the screen. Translucent draws have a blend state, and with
+    // blend_mode::OrderIndependent the accumulators of oit, one per pixel.
+    struct raster_target
+    {
+        float* depth;
+        unsigned char* color;
+        int width, height;
+        int samples;
+        int pixel_bytes;
+        pixel_format format;
+        int depth_top;
+        const blend_state* blend;
+        oit_pixel* oit;
+
+        std::size_t first_sample(int x, int y) const
+        {
+            return ((std::size_t)(height - 1 - y) * width + x) * samples;
+        }
+
+        std::size_t first_depth(int x, int y) const
+        {
+            return ((std::size_t)(depth_top - y) * width + x) * samples;
+        }
+    };
+
+    inline bool inside_edge(float e, bool top_left)
+    {
+        return e > 0 || (e == 0 && top_left);
+    }
+
+    // Per triangle sample offsets of the edge functions and depth, relative to the pixel centre
+    struct sample_setup
+    {
+        float edge_offset[3][16];
+        float z_offset[16];
+        float reach[3];
+    };
+
+    // Narrow [lo, hi] to the pixels x in [x1, x2] where e0 + a * (x - x1) > t
+    inline void clip_span(float e0, float a, float t, int x1, int x2, int& lo, int& hi)
+    {
+        if (a == 0)
+        {
+            if (!(e0 > t))
+            {
+                lo = x2 + 1;
+            }
+            return;
+        }
+        float bound = std::min(std::max((t - e0) / a, -1.0f), (float)(x2 - x1 + 1));
+        if (a > 0)
+        {
+            lo = std::max(lo, x1 + (int)std::floor(bound) + 1);
+        }
+        else
+        {
+            hi = std::min(hi, x1 + (int)std::ceil(bound) - 1);
+        }
+    }
+
+    // One row of pixels with n samples each; depth and color point at the first sample of pixel x1.
+    // The row is split analytically into pixels that cannot touch the triangle (skipped), pixels whose
+    // samples are all inside (depth test only) and the edge pixels in between, tested sample by sample.
+    // shade(x) gives the colour of pixel x and is called at most once per pixel, only if a sample passes.
+    // Edge pixels evaluate a * (x + 0.5) + (b * sy + c), the same expression whichever triangle and row
+    // start, so the two triangles of a shared edge get exactly opposite values and the fill rule gives
+    // a sample on it to exactly one of them.
+    template <int Bytes, int n, class Shade>
+    void sample_row(const triangle_setup& s, const sample_setup& ss, int x1, int x2, float sy,
+                    float* depth, unsigned char* color, const Shade& shade, bool depth_test)
+    {
+        float sx = (float)x1 + 0.5f;
+        float e_base[3], e_row[3], z_row = s.z_a * sx + s.z_b * sy + s.z_c;
+        for (int e = 0; e < 3; ++e) {
+            e_base[e] = s.edge_b[e] * sy + s.edge_c[e];
+            e_row[e] = s.edge_a[e] * sx + e_base[e];
+        }
+
+        // Both ranges get a pixel of slack so rounding can only send pixels down the exact path
+        int lo = x1, hi = x2, in_lo = x1, in_hi = x2;
+        for (int e = 0; e < 3; ++e) {
+            clip_span(e_row[e], s.edge_a[e], -ss.reach[e], x1, x2, lo, hi);
+            clip_span(e_row[e], s.edge_a[e], ss.reach[e], x1, x2, in_lo, in_hi);
+        }
+        lo = std::max(x1, lo - 1);
+        hi = std::min(x2, hi + 1);
+        in_lo += 1;
+        in_hi -= 1;
+
+        // Both branches compile for every Shade, the constant condition drops the unused one (C++14 has
+        // no if constexpr)
+        const bool packed_fill = Shade::flat && Bytes == 4;
+        std::uint32_t packed = 0;
+        if (packed_fill) {
+            std::memcpy(&packed, shade(0), 4);
+        }
+
+        for (int x = lo; x <= hi; x++) {
+            float dx = (float)(x - x1);
+            float zc = z_row + s.z_a * dx;
+            float* d = depth + (size_t)(x - x1) * n;
+            unsigned char* c = color + (size_t)(x - x1) * n * Bytes;
+            const unsigned char* pixel = nullptr;
+
+            if (x >= in_lo && x <= in_hi) {
+                RST_STAT(thread_counters->pixels_covered += n);
+                if (packed_fill) {
+                    // Branch-free so the compiler can vectorize it
+                    std::uint32_t out[n];
+                    std::memcpy(out, c, sizeof(out));
+                    for (int k = 0; k < n; ++k) {
+                        float z = zc + ss.z_offset[k];
+                        bool pass = !depth_test || d[k] > z;
+                        RST_STAT(thread_counters->depth_passed += pass);
+                        d[k] = pass ? z : d[k];
+                        out[k] = pass ? packed : out[k];
+                    }
+                    std::memcpy(c, out, sizeof(out));
+                }
+                else {
+                    for (int k = 0; k < n; ++k) {
+                        float z = zc + ss.z_offset[k];
+                        if (!depth_test || d[k] > z) {
+                            RST_STAT(thread_counters->depth_passed++);
+                            d[k] = z;
+                            pixel = pixel ? pixel : shade(x);
+                            std::memcpy(c + k * Bytes, pixel, Bytes);
+                        }
+                    }
+                }
+                continue;
+            }
+
+            float ec[3];
+            for (int e = 0; e < 3; ++e) {
+                ec[e] = s.edge_a[e] * ((float)x + 0.5f) + e_base[e];
+            }
+            for (int k = 0; k < n; ++k) {
+                if (!(inside_edge(ec[0] + ss.edge_offset[0][k], s.top_left[0])
+                      && inside_edge(ec[1] + ss.edge_offset[1][k], s.top_left[1])
+                      && inside_edge(ec[2] + ss.edge_offset[2][k], s.top_left[2]))) {
+                    continue;
+                }
+                RST_STAT(thread_counters->pixels_covered++);
+                float z = zc + ss.z_offset[k];
+                if (!depth_test || d[k] > z) {
+                    RST_STAT(thread_counters->depth_passed++);
+                    d[k] = z;
+                    pixel = pixel ? pixel : shade(x);
+                    std::memcpy(c + k * Bytes, pixel, Bytes);
+                }
+            }
+        }
+    }
+
+    /*
+     * One row of a translucent triangle, as sample_row but without writing depth: the samples of pixel x
+     * that are covered and pass the depth test are blended with shade.rgba(x) (colour and alpha), or with
+     * the order-independent mode the pixel's accumulator oit[x - x1] takes the fragment once, weighted by
+     * the fraction of the samples that passed.
+     * */
+    template <int n, class Shade>
+    void blend_row(const triangle_setup& s, const sample_setup& ss, int x1, int x2, float sy, const float* depth,
+                   unsigned char* color, oit_pixel* oit, const blend_state& blend, int bytes, pixel_format format,
+                   const Shade& shade, bool depth_test)
+    {
+        float sx = (float)x1 + 0.5f;
+        float e_base[3], e_row[3], z_row = s.z_a * sx + s.z_b * sy + s.z_c;
+        int lo = x1, hi = x2;
+        for (int e = 0; e < 3; ++e) {
+            e_base[e] = s.edge_b[e] * sy + s.edge_c[e];
+            e_row[e] = s.edge_a[e] * sx + e_base[e];
+            clip_span(e_row[e], s.edge_a[e], -ss.reach[e], x1, x2, lo, hi);
+        }
+        lo = std::max(x1, lo - 1);
+        hi = std::min(x2, hi + 1);
+
+        for (int x = lo; x <= hi; x++) {
+            float dx = (float)(x - x1);
+            float zc = z_row + s.z_a * dx;
+            const float* d = depth + (size_t)(x - x1) * n;
+            float ec[3];
+            for (int e = 0; e < 3; ++e) {
+                ec[e] = s.edge_a[e] * ((float)x + 0.5f) + e_base[e];
+            }
+            unsigned passed = 0;
+            for (int k = 0; k < n; ++k) {
+                if (!(inside_edge(ec[0] + ss.edge_offset[0][k], s.top_left[0])
+                      && inside_edge(ec[1] + ss.edge_offset[1][k], s.top_left[1])
+                      && inside_edge(ec[2] + ss.edge_offset[2][k], s.top_left[2]))) {
+                    continue;
+                }
+                RST_STAT(thread_counters->pixels_covered++);
+                if (!depth_test || d[k] > zc + ss.z_offset[k]) {
+                    passed |= 1u << k;
+                }
+            }
+            if (!passed) {
+                continue;
+            }
+            RST_STAT(thread_counters->depth_passed += count_bits(passed));
+
+            Eigen::Vector4f src = shade.rgba(x);
+            src.w() *= blend.alpha;
+            if (oit) {
+                accumulate(oit[x - x1], src, zc + blend.depth_shift, (float)count_bits(passed) / n);
+                continue;
+            }
+            unsigned char* c = color + (size_t)(x - x1) * n * bytes;
+            for (int k = 0; k < n; ++k) {
+                if (passed & (1u << k)) {
+                    blend_pixel(blend.mode, format, src, c + k * bytes);
+                }
+            }
+        }
+    }
+
+    template <class Shade>
+    auto blend_row_for(int n)
+    {
+        switch (n)
+        {
+        case 1: return blend_row<1, Shade>;
+        case 2: return blend_row<2, Shade>;
+        case 4: return blend_row<4, Shade>;
+        case 8: return blend_row<8, Shade>;
+        default: return blend_row<16, Shade>;
+        }
+    }
+
+    template <int Bytes, class Shade>
+    auto sample_row_for(int n)
+    {
+        switch (n)
+        {
+        case 1: return sample_row<Bytes, 1, Shade>;
+        case 2: return sample_row<Bytes, 2, Shade>;
+        case 4: return sample_row<Bytes, 4, Shade>;
+        case 8: return sample_row<Bytes, 8, Shade>;
+        default: return sample_row<Bytes, 16, Shade>;
+        }
+    }
+
+    template <class Shade>
+    auto sample_row_for(int n, int bytes)
+    {
+        switch (bytes)
+        {
+        case 4: return sample_row_for<4, Shade>(n);
+        case 8: return sample_row_for<8, Shade>(n);
+        case 16: return sample_row_for<16, Shade>(n);
+        default: return sample_row_for<12, Shade>(n);
+        }
+    }
+
+    // Rows y1..y2, pixels x1..x2, of a triangle; row_shade(y, sy) makes the Shade of row y, whose samples
+    // are centred on sy. Translucent triangles go through blend_row.
+    template <class Shade, class RowShade>
+    void rasterize_rows(const raster_target& target, const triangle_setup& s, const sample_setup& ss,
+                        int x1, int y1, int x2, int y2, const RowShade& row_shade, bool depth_test)
+    {
+        if (target.blend) {
+            auto blend_fn = blend_row_for<Shade>(target.samples);
+            for (int y = y1; y <= y2; y++) {
+                std::size_t first = target.first_sample(x1, y);
+                float sy = (float)y + 0.5f;
+                oit_pixel* oit = target.oit ? target.oit + first / target.samples : nullptr;
+                blend_fn(s, ss, x1, x2, sy, target.depth + target.first_depth(x1, y), target.color + first * target.pixel_bytes,
+                         oit, *target.blend, target.pixel_bytes, target.format, row_shade(y, sy), depth_test);
+            }
+            return;
+        }
+        auto row_fn = sample_row_for<Shade>(target.samples, target.pixel_bytes);
+        for (int y = y1; y <= y2; y++) {
+            std::size_t first = target.first_sample(x1, y);
+            float sy = (float)y + 0.5f;
+            row_fn(s, ss, x1, x2, sy, target.depth + target.first_depth(x1, y), target.color + first * target.pixel_bytes,
+                   row_shade(y, sy), depth_test);
+        }
+    }
+}
@@ -8,199 +8,1597 @@
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
+#include <stdexcept>
+#include <cfloat>
+#include <cstring>
+#include <cstdint>
+#include <exception>
+#include <string>
 
 
 rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
+    return {pos_buf.add(std::vector<Eigen::Vector3f>(positions))};
+}
+
+rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+{
+    return {ind_buf.add(std::vector<Eigen::Vector3i>(indices))};
+}
+
+rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
+{
+    return {col_buf.add(std::vector<Eigen::Vector3f>(cols))};
+}
+
+rst::pos_buf_id rst::rasterizer::load_positions(std::vector<Eigen::Vector3f> &&positions)
+{
+    return {pos_buf.add(std::move(positions))};
+}
+
+rst::ind_buf_id rst::rasterizer::load_indices(std::vector<Eigen::Vector3i> &&indices)
+{
+    return {ind_buf.add(std::move(indices))};
+}
+
+rst::col_buf_id rst::rasterizer::load_colors(std::vector<Eigen::Vector3f> &&cols)
+{
+    return {col_buf.add(std::move(cols))};
+}
+
+rst::pos_buf_id rst::rasterizer::load_positions(const Eigen::Vector3f *data, size_t count, std::shared_ptr<const void> owner)
+{
+    return {pos_buf.add(data, count, std::move(owner))};
+}
+
+rst::ind_buf_id rst::rasterizer::load_indices(const Eigen::Vector3i *data, size_t count, std::shared_ptr<const void> owner)
+{
+    return {ind_buf.add(data, count, std::move(owner))};
+}
+
+rst::col_buf_id rst::rasterizer::load_colors(const Eigen::Vector3f *data, size_t count, std::shared_ptr<const void> owner)
+{
+    return {col_buf.add(data, count, std::move(owner))};
+}
+
+void rst::rasterizer::unload(pos_buf_id id)
+{
+    pos_buf.remove(id.pos_id);
+}
+
+void rst::rasterizer::unload(ind_buf_id id)
+{
+    ind_buf.remove(id.ind_id);
+}
+
+void rst::rasterizer::unload(col_buf_id id)
+{
+    col_buf.remove(id.col_id);
+}
+
+auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
+{
+    return Vector4f(v3.x(), v3.y(), v3.z(), w);
+}
+
+
+// Triangle setup: the three edge functions e_i(x, y) = a_i * x + b_i * y + c_i (edge i lies opposite
+// vertex i), scaled so that the inside of the triangle is positive whatever its winding, plus the
+// depth plane. The barycentric weight of vertex i is e_i / area. Returns false for degenerate triangles
+// and for those facing the culled way.
+static bool setupTriangle(const Triangle& t, rst::triangle_setup& s, rst::Cull cull)
+{
+    const Vector3f* v = t.v;
+    for (int i = 0; i < 3; ++i)
+    {
+        const Vector3f& p = v[(i + 1) % 3];
+        const Vector3f& q = v[(i + 2) % 3];
+        s.edge_a[i] = p.y() - q.y();
+        s.edge_b[i] = q.x() - p.x();
+        s.edge_c[i] = p.x() * q.y() - q.x() * p.y();
+    }
+
+    // Twice the signed area, positive for counter clockwise vertices on screen
+    float area = s.edge_a[0] * v[0].x() + s.edge_b[0] * v[0].y() + s.edge_c[0];
+    if (area == 0 || !std::isfinite(area))
+    {
+        return false;
+    }
+    if ((cull == rst::Cull::CCW && area > 0) || (cull == rst::Cull::CW && area < 0))
+    {
+        return false;
+    }
+    if (area < 0)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            s.edge_a[i] = -s.edge_a[i];
+            s.edge_b[i] = -s.edge_b[i];
+            s.edge_c[i] = -s.edge_c[i];
+        }
+        area = -area;
+    }
+    s.inv_area = 1.0f / area;
+
+    // Top-left fill rule: a sample exactly on an edge belongs to the triangle only if the edge is a
+    // left edge (inside lies towards +x) or a top edge (horizontal, inside lies towards -y), so pixels
+    // on an edge shared by two triangles are drawn exactly once.
+    for (int i = 0; i < 3; ++i)
+    {
+        s.top_left[i] = s.edge_a[i] > 0 || (s.edge_a[i] == 0 && s.edge_b[i] < 0);
+    }
+
+    s.z_a = (s.edge_a[0] * v[0].z() + s.edge_a[1] * v[1].z() + s.edge_a[2] * v[2].z()) * s.inv_area;
+    s.z_b = (s.edge_b[0] * v[0].z() + s.edge_b[1] * v[1].z() + s.edge_b[2] * v[2].z()) * s.inv_area;
+    s.z_c = (s.edge_c[0] * v[0].z() + s.edge_c[1] * v[1].z() + s.edge_c[2] * v[2].z()) * s.inv_area;
+    s.z_min = std::min(v[0].z(), std::min(v[1].z(), v[2].z()));
+    s.z_max = std::max(v[0].z(), std::max(v[1].z(), v[2].z()));
+
+    //εx,y,Сֱֵ,תΪ
+    s.x_min = (int)std::floor(std::min(v[0].x(), std::min(v[1].x(), v[2].x())));
+    s.x_max = (int)std::ceil(std::max(v[0].x(), std::max(v[1].x(), v[2].x())));
+    s.y_min = (int)std::floor(std::min(v[0].y(), std::min(v[1].y(), v[2].y())));
+    s.y_max = (int)std::ceil(std::max(v[0].y(), std::max(v[1].y(), v[2].y())));
+    return true;
+}
+
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
+{
+    // Throws for ids that are unknown or have been unloaded
+    auto buf = pos_buf.get(pos_buffer.pos_id);
+    auto ind = ind_buf.get(ind_buffer.ind_id);
+    auto col = col_buf.get(col_buffer.col_id);
+    begin_frame();
+    RST_STAT(current_stats.counters.draws++);
+    RST_STAT(current_stats.counters.vertices += buf.size);
+    RST_STAT(current_stats.counters.triangles += ind.size);
+
+    {
+        RST_STAT(stage_timer timer(current_stats, pipeline_stage::Vertex, stats_epoch));
+        Eigen::Matrix4f mvp = projection * view * model;
+        if (flip_w())
+        {
+            mvp = -mvp;
+        }
+        // Every vertex is transformed once; the triangles below only read the cache
+        transform_vertices(buf.data, buf.size, mvp, screen_viewport(), clipping, simd, verts);
+    }
+
+    if (type == Primitive::Line)
+    {
+        RST_STAT(stage_timer timer(current_stats, pipeline_stage::Raster, stats_epoch));
+        rasterize_wireframe(ind, buf.size);
+        return;
+    }
+
+    // The vertex colours are the varyings of the fixed function pipeline
+    shader_fn = nullptr;
+    span_shader_fn = nullptr;
+    shader_obj = nullptr;
+    assemble(ind, std::min(buf.size, col.size), col.data ? col.data->data() : nullptr, 3);
+    rasterize_draw();
+}
+
+// The edges of every triangle as lines; triangles with a vertex behind the camera are left out
+void rst::rasterizer::rasterize_wireframe(const buffer_span<Eigen::Vector3i>& ind, size_t vertex_count)
+{
+    for (auto& i : ind)
+    {
+        Eigen::Vector3f v[3];
+        bool behind = false;
+        for (int k = 0; k < 3; ++k)
+        {
+            if ((size_t)i[k] >= vertex_count)
+            {
+                throw std::runtime_error("Vertex index " + std::to_string(i[k]) + " out of range");
+            }
+            behind = behind || verts.w[i[k]] < clipping.w_min;
+            v[k] = Vector3f(verts.sx[i[k]], verts.sy[i[k]], verts.sz[i[k]]);
+        }
+        if (!behind)
+        {
+            draw_line(v[2], v[0]);
+            draw_line(v[2], v[1]);
+            draw_line(v[1], v[0]);
+        }
+    }
+}
 
-    return {id};
+// Bresenham's algorithm in white. The line is clipped to the screen first (Liang-Barsky), so lines
+// reaching far off screen cost only their visible pixels.
+void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
+{
+    float t0 = 0, t1 = 1;
+    Eigen::Vector2f d = end.head<2>() - begin.head<2>();
+    Eigen::Vector2f lo(0, 0), hi(width - 1.0f, height - 1.0f);
+    for (int k = 0; k < 2; ++k)
+    {
+        if (d[k] == 0)
+        {
+            if (begin[k] < lo[k] || begin[k] > hi[k])
+            {
+                return;
+            }
+            continue;
+        }
+        float a = (lo[k] - begin[k]) / d[k];
+        float b = (hi[k] - begin[k]) / d[k];
+        t0 = std::max(t0, std::min(a, b));
+        t1 = std::min(t1, std::max(a, b));
+    }
+    if (t0 > t1)
+    {
+        return;
+    }
+
+    int x1 = (int)(begin.x() + t0 * d.x());
+    int y1 = (int)(begin.y() + t0 * d.y());
+    int x2 = (int)(begin.x() + t1 * d.x());
+    int y2 = (int)(begin.y() + t1 * d.y());
+
+    Eigen::Vector3f line_color = {255, 255, 255};
+    auto plot = [&](int x, int y) {
+        // Rounding in the clip may leave an end a pixel off screen
+        if (x >= 0 && x < width && y >= 0 && y < height)
+        {
+            set_pixel(Eigen::Vector3f(x, y, 1.0f), line_color);
+        }
+    };
+
+    int x, y, xe, ye;
+    int dx = x2 - x1;
+    int dy = y2 - y1;
+    int dx1 = std::abs(dx);
+    int dy1 = std::abs(dy);
+    int px = 2 * dy1 - dx1;
+    int py = 2 * dx1 - dy1;
+
+    if (dy1 <= dx1)
+    {
+        if (dx >= 0)
+        {
+            x = x1;
+            y = y1;
+            xe = x2;
+        }
+        else
+        {
+            x = x2;
+            y = y2;
+            xe = x1;
+        }
+        plot(x, y);
+        while (x < xe)
+        {
+            x = x + 1;
+            if (px < 0)
+            {
+                px = px + 2 * dy1;
+            }
+            else
+            {
+                y += ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) ? 1 : -1;
+                px = px + 2 * (dy1 - dx1);
+            }
+            plot(x, y);
+        }
+    }
+    else
+    {
+        if (dy >= 0)
+        {
+            x = x1;
+            y = y1;
+            ye = y2;
+        }
+        else
+        {
+            x = x2;
+            y = y2;
+            ye = y1;
+        }
+        plot(x, y);
+        while (y < ye)
+        {
+            y = y + 1;
+            if (py <= 0)
+            {
+                py = py + 2 * dx1;
+            }
+            else
+            {
+                x += ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) ? 1 : -1;
+                py = py + 2 * (dx1 - dy1);
+            }
+            plot(x, y);
+        }
+    }
+}
+
+rst::viewport rst::rasterizer::screen_viewport() const
+{
+    return make_viewport(width, height, projection, reversed);
+}
+
+// The clip stage wants w > 0 in front of the camera. Scaling the whole clip space position by -1 leaves
+// the divided coordinates unchanged, so positions from projections that make w negative there are flipped.
+bool rst::rasterizer::flip_w() const
+{
+    return projection.row(3).dot(Eigen::Vector4f(0, 0, -1, 1)) < 0;
+}
+
+// The fragment stage of the fixed function pipeline for interpolated vertex colours, for deferred shading
+struct vertex_colors
+{
+    static const vertex_colors instance;
+
+    std::uint32_t reads() const { return 0x7; }
+    Eigen::Vector3f fragment(int, int, const float* in) const { return Eigen::Vector3f(in[0], in[1], in[2]); }
+};
+
+const vertex_colors vertex_colors::instance{};
+
+// Primitive assembly from the vertex cache: culls and clips the triangles of the index buffer and sets up
+// what is left. Vertex v has count varyings at attributes + v * count; indices must be below vertex_count.
+void rst::rasterizer::assemble(const buffer_span<Eigen::Vector3i>& ind, size_t vertex_count, const float* attributes, int count)
+{
+    RST_STAT(stage_timer timer(current_stats, pipeline_stage::Assembly, stats_epoch));
+    viewport vp = screen_viewport();
+    screen_tris.clear();
+    setups.clear();
+    tri_varyings.clear();
+    if (!deferred_mode || samples > 1)
+    {
+        // The deferred pass still needs the varyings of earlier draw calls; they go at frame start
+        varyings.clear();
+    }
+    tri_primitives.clear();
+    assembled_varyings = count;
+    for (auto& i : ind)
+    {
+        int primitive = (int)(&i - ind.begin());
+        for (int k = 0; k < 3; ++k)
+        {
+            if ((size_t)i[k] >= vertex_count)
+            {
+                throw std::runtime_error("Vertex index " + std::to_string(i[k]) + " out of range");
+            }
+        }
+
+        std::uint16_t c0 = verts.code[i[0]], c1 = verts.code[i[1]], c2 = verts.code[i[2]];
+        if (c0 & c1 & c2 & clip_volume::outside_mask)
+        {
+            // All three vertices lie outside the same plane of the view volume
+            RST_STAT(current_stats.counters.triangles_outside++);
+            continue;
+        }
+
+        const float* values[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            values[k] = attributes + (size_t)i[k] * count;
+        }
+
+        std::uint16_t planes = (c0 | c1 | c2) & clip_volume::guard_mask;
+        if (!planes)
+        {
+            Triangle t;
+            float inv_w[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                t.setVertex(k, Vector3f(verts.sx[i[k]], verts.sy[i[k]], verts.sz[i[k]]));
+                inv_w[k] = 1.0f / verts.w[i[k]];
+            }
+            add_triangle(t, inv_w, values, count, primitive);
+            continue;
+        }
+
+        RST_STAT(current_stats.counters.triangles_clipped++);
+        clip_vertex corners[3], polygon[10];
+        for (int k = 0; k < 3; ++k)
+        {
+            corners[k] = {{verts.x[i[k]], verts.y[i[k]], verts.z[i[k]], verts.w[i[k]]}, {0, 0, 0}};
+            corners[k].weight[k] = 1;
+        }
+        int corner_count = clip_triangle(corners, planes, clipping, polygon);
+
+        // The clipped polygon is convex, a fan around its first vertex covers it. The varyings of the new
+        // vertices follow their weights, which is exact since clipping interpolates before the division;
+        // varyings that are the same at all three corners are copied so they stay exactly the same.
+        bool uniform = std::equal(values[0], values[0] + count, values[1]) && std::equal(values[0], values[0] + count, values[2]);
+        Eigen::Vector3f screen[10];
+        float inv_w[10], polygon_values[10][max_varyings];
+        for (int k = 0; k < corner_count; ++k)
+        {
+            const float* p = polygon[k].pos;
+            const float* w = polygon[k].weight;
+            screen[k] = vp.to_screen(p[0], p[1], p[2], p[3]);
+            inv_w[k] = 1.0f / p[3];
+            for (int j = 0; j < count; ++j)
+            {
+                if (uniform)
+                {
+                    polygon_values[k][j] = values[0][j];
+                    continue;
+                }
+                // A weighted mean lies between the corner values, rounding may carry it just past them (a
+                // colour of 255 to 255.00002, which Triangle::setColor rejects)
+                float lo = std::min({values[0][j], values[1][j], values[2][j]});
+                float hi = std::max({values[0][j], values[1][j], values[2][j]});
+                float v = w[0] * values[0][j] + w[1] * values[1][j] + w[2] * values[2][j];
+                polygon_values[k][j] = std::min(std::max(v, lo), hi);
+            }
+        }
+        for (int k = 2; k < corner_count; ++k)
+        {
+            Triangle part;
+            int fan[3] = {0, k - 1, k};
+            float fan_inv_w[3];
+            const float* fan_values[3];
+            for (int j = 0; j < 3; ++j)
+            {
+                part.setVertex(j, screen[fan[j]]);
+                fan_inv_w[j] = inv_w[fan[j]];
+                fan_values[j] = polygon_values[fan[j]];
+            }
+            add_triangle(part, fan_inv_w, fan_values, count, primitive);
+        }
+    }
+}
+
+// Bin the assembled triangles and rasterize them tile by tile
+void rst::rasterizer::rasterize_draw()
+{
+    {
+        RST_STAT(stage_timer timer(current_stats, pipeline_stage::Binning, stats_epoch));
+        bin_triangles();
+    }
+    if (blend != blend_mode::Opaque && blend != blend_mode::OrderIndependent && deferred_pending)
+    {
+        // The direct blend modes need the colours of the opaque pixels under them
+        shade_deferred();
+    }
+    samples_dirty = samples_dirty || samples > 1;
+    if (deferring())
+    {
+        // Remember how to shade every triangle of this draw call until the frame is resolved
+        deferred_base = (std::uint32_t)deferred_tris.size();
+        int draw = (int)draw_varyings.size();
+        draw_varyings.push_back(assembled_varyings);
+        for (int i = 0; i < (int)screen_tris.size(); ++i)
+        {
+            const Triangle& t = screen_tris[i];
+            deferred_triangle d{nullptr, nullptr, tri_varyings[i], draw, tri_primitives[i], {}};
+            if (span_shader_fn)
+            {
+                d.shade = span_shader_fn;
+                d.shader = shader_obj;
+            }
+            else if (t.color[0] != t.color[1] || t.color[0] != t.color[2])
+            {
+                d.shade = &shade_span<vertex_colors>;
+                d.shader = &vertex_colors::instance;
+            }
+            else
+            {
+                encode_pixel(fmt, screen_tris[i].getColor(), d.pixel);
+            }
+            deferred_tris.push_back(d);
+        }
+        deferred_pending = deferred_pending || !screen_tris.empty();
+    }
+
+    RST_STAT(stage_timer timer(current_stats, pipeline_stage::Raster, stats_epoch));
+    if (pool)
+    {
+        // Tiles own disjoint pixels, so they can be rasterized in any order on any thread
+        pool->parallel_for((int)tile_bins.size(), [this](int tile, int participant) { run_tile(tile, participant); });
+    }
+    else
+    {
+        for (int tile = 0; tile < (int)tile_bins.size(); ++tile)
+        {
+            run_tile(tile, 0);
+        }
+    }
+}
+
+// Rasterize a tile for thread participant of the pool, which counts the pixel work for that thread
+void rst::rasterizer::run_tile(int tile, int participant)
+{
+#if RST_STATS
+    pipeline_counters counters;
+    thread_counters = &counters;
+    try
+    {
+        rasterize_tile(tile, participant);
+    }
+    catch (...)
+    {
+        // A throwing shader must not leave the thread pointing at this frame's counters
+        thread_counters = nullptr;
+        throw;
+    }
+    thread_counters = nullptr;
+    tile_counters[participant].add(counters);
+#else
+    rasterize_tile(tile, participant);
+#endif
+}
+
+// A triangle whose bounding box is thinner than a pixel may fall between the sample rows or columns.
+// The box is widened by a margin, as the rounded edge functions can still cover a sample a hair outside
+// of it; culling such a triangle would leave a hole where its neighbour leaves the sample to it.
+bool rst::rasterizer::misses_samples(const Triangle& t) const
+{
+    const float margin = 1.0f / 64;
+    float x_min = std::min(t.v[0].x(), std::min(t.v[1].x(), t.v[2].x())) - margin;
+    float x_max = std::max(t.v[0].x(), std::max(t.v[1].x(), t.v[2].x())) + margin;
+    float y_min = std::min(t.v[0].y(), std::min(t.v[1].y(), t.v[2].y())) - margin;
+    float y_max = std::max(t.v[0].y(), std::max(t.v[1].y(), t.v[2].y())) + margin;
+    if (x_max - x_min >= 1 && y_max - y_min >= 1)
+    {
+        return false;
+    }
+
+    // Sample k of pixel (x, y) lies at (x + 0.5 + sample_x[k], y + 0.5 + sample_y[k])
+    for (int k = 0; k < samples; ++k)
+    {
+        float ox = 0.5f + sample_x[k];
+        float oy = 0.5f + sample_y[k];
+        if (std::ceil(x_min - ox) <= std::floor(x_max - ox) && std::ceil(y_min - oy) <= std::floor(y_max - oy))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Set up a screen space triangle and queue it for binning, its bounding box clamped to the screen.
+// inv_w holds 1 / w of the vertices in clip space and values their count varyings; primitive is the
+// triangle's index in the index buffer.
+void rst::rasterizer::add_triangle(Triangle& t, const float inv_w[3], const float* const values[3], int count, int primitive)
+{
+    triangle_setup setup;
+    if (!setupTriangle(t, setup, cull) || misses_samples(t))
+    {
+        RST_STAT(current_stats.counters.triangles_culled++);
+        return;
+    }
+    setup.x_min = std::max(setup.x_min, 0);
+    setup.y_min = std::max(setup.y_min, 0);
+    setup.x_max = std::min(setup.x_max, width - 1);
+    setup.y_max = std::min(setup.y_max, height - 1);
+    if (setup.x_min > setup.x_max || setup.y_min > setup.y_max)
+    {
+        RST_STAT(current_stats.counters.triangles_culled++);
+        return;
+    }
+    RST_STAT(current_stats.counters.triangles_rasterized++);
+
+    // Without a shader the varyings are the vertex colours. A single colour is written as it is; only
+    // triangles with differing vertex colours pay for interpolation. The visibility buffer keeps the
+    // varyings of every triangle, so that any of them can be reshaded.
+    screen_tris.push_back(t);
+    setups.push_back(setup);
+    tri_primitives.push_back(primitive);
+    if (!shader_fn)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            screen_tris.back().setColor(k, values[k][0], values[k][1], values[k][2]);
+        }
+        if (!deferring() && std::equal(values[0], values[0] + 3, values[1]) && std::equal(values[0], values[0] + 3, values[2]))
+        {
+            tri_varyings.push_back(-1);
+            return;
+        }
+    }
+
+    tri_varyings.push_back((int)varyings.size());
+    varyings.emplace_back();
+    setup_varyings(setup, inv_w, values, count, varyings.back());
+}
+
+// Sort the screen space triangles of the current draw call into the tiles their bounding box overlaps.
+// Triangles keep their submission order inside every bin, so the depth test resolves ties exactly
+// as it would if the triangles were drawn one after another over the whole screen.
+void rst::rasterizer::bin_triangles()
+{
+    for (auto& bin : tile_bins)
+    {
+        bin.clear();
+    }
+
+    for (int i = 0; i < (int)screen_tris.size(); ++i)
+    {
+        auto& s = setups[i];
+        int tx1 = std::max(0, s.x_min / tile_size);
+        int tx2 = std::min(tiles_x - 1, s.x_max / tile_size);
+        int ty1 = std::max(0, s.y_min / tile_size);
+        int ty2 = std::min(tiles_y - 1, s.y_max / tile_size);
+
+        for (int ty = ty1; ty <= ty2; ++ty)
+        {
+            for (int tx = tx1; tx <= tx2; ++tx)
+            {
+                // Depth only ever decreases, so a tile already in front of the whole triangle stays so
+                int tile = ty * tiles_x + tx;
+                if (s.z_min < hiz[tile].z_max)
+                {
+                    tile_bins[tile].push_back(i);
+                    RST_STAT(current_stats.counters.tile_triangles++);
+                }
+                else
+                {
+                    RST_STAT(current_stats.counters.tile_rejects++);
+                }
+            }
+        }
+    }
+}
+
+// Rasterize every triangle binned into one tile, clipped to the tile, so the tile's
+// colour and depth stay in cache while it is being shaded.
+void rst::rasterizer::rasterize_tile(int tile, int participant)
+{
+    if (tile_bins[tile].empty())
+    {
+        return;
+    }
+
+    int x_min = (tile % tiles_x) * tile_size;
+    int y_min = (tile / tiles_x) * tile_size;
+    int x_max = std::min(x_min + tile_size, width) - 1;
+    int y_max = std::min(y_min + tile_size, height) - 1;
+    auto& z = hiz[tile];
+
+    // Corners of the tile: the depth plane of a triangle takes its extremes over the tile there, and a
+    // triangle covering all four covers every sample of the tile
+    const float cx[4] = {(float)x_min, x_max + 1.0f, (float)x_min, x_max + 1.0f};
+    const float cy[4] = {(float)y_min, (float)y_min, y_max + 1.0f, y_max + 1.0f};
+
+    // Nothing of the tile is cleared or unpacked until a triangle passes the hierarchical test, and then
+    // only the depth under the triangles that do
+    depth_rows depth = open_tile_depth(tile, participant);
+    bool touched = false;
+    for (int i : tile_bins[tile])
+    {
+        auto& s = setups[i];
+        float plane_min = FLT_MAX, plane_max = -FLT_MAX;
+        bool covers_tile = true;
+        for (int k = 0; k < 4; ++k)
+        {
+            float pz = s.z_a * cx[k] + s.z_b * cy[k] + s.z_c;
+            plane_min = std::min(plane_min, pz);
+            plane_max = std::max(plane_max, pz);
+            for (int e = 0; e < 3; ++e)
+            {
+                covers_tile = covers_tile && s.edge_a[e] * cx[k] + s.edge_b[e] * cy[k] + s.edge_c[e] > 0;
+            }
+        }
+        float tri_min = std::max(s.z_min, plane_min);
+        float tri_max = std::min(s.z_max, plane_max);
+
+        // Everything already drawn here is in front of the triangle: reject it without touching a pixel.
+        // The stored maximum is conservative, so for large triangles it is worth tightening first,
+        // as long as enough has been drawn since the last rescan to pay for another one.
+        if (tri_min >= z.z_max)
+        {
+            RST_STAT(thread_counters->tile_rejects++);
+            continue;
+        }
+        int area = (std::min(s.x_max, x_max) - std::max(s.x_min, x_min) + 1)
+                 * (std::min(s.y_max, y_max) - std::max(s.y_min, y_min) + 1);
+        if (!z.exact && area * 4 >= tile_size * tile_size && z.draws >= 4)
+        {
+            update_tile_depth(tile, depth);
+            if (tri_min >= z.z_max)
+            {
+                RST_STAT(thread_counters->tile_rejects++);
+                continue;
+            }
+        }
+
+        load_tile_depth(tile, depth, std::max(s.x_min, x_min), std::max(s.y_min, y_min),
+                        std::min(s.x_max, x_max), std::min(s.y_max, y_max));
+        if (!touched)
+        {
+            touch_tile(tile, blend == blend_mode::OrderIndependent ? clear_all | clear_oit : clear_all, false);
+            touched = true;
+        }
+
+        // The triangle is in front of everything drawn here: every covered pixel passes the depth test
+        bool depth_test = !(tri_max < z.z_min);
+        if (deferring())
+        {
+            rasterize_ids(s, deferred_base + i + 1, x_min, y_min, x_max, y_max, depth, depth_test);
+        }
+        else
+        {
+            const varying_setup* v = tri_varyings[i] < 0 ? nullptr : &varyings[tri_varyings[i]];
+            rasterize_triangle(screen_tris[i], s, v, x_min, y_min, x_max, y_max, depth, depth_test);
+        }
+        if (blend != blend_mode::Opaque)
+        {
+            // Translucent triangles leave the depth as it was
+            continue;
+        }
+
+        z.z_min = std::min(z.z_min, tri_min);
+        if (covers_tile)
+        {
+            z.z_max = std::min(z.z_max, tri_max);
+        }
+        z.exact = false;
+        z.draws++;
+    }
+    store_tile_depth(tile, depth);
+}
+
+// Recompute the exact depth range of a tile from its depth samples
+void rst::rasterizer::update_tile_depth(int tile, depth_rows& depth)
+{
+    if (tile_clears[tile] & clear_depth)
+    {
+        hiz[tile] = tile_depth{cleared_depth, cleared_depth};
+        return;
+    }
+    int x_min = (tile % tiles_x) * tile_size;
+    int y_min = (tile / tiles_x) * tile_size;
+    int x_max = std::min(x_min + tile_size, width) - 1;
+    int y_max = std::min(y_min + tile_size, height) - 1;
+
+    load_tile_depth(tile, depth, x_min, y_min, x_max, y_max);
+    float lo = std::numeric_limits<float>::infinity();
+    float hi = -std::numeric_limits<float>::infinity();
+    for (int y = y_min; y <= y_max; ++y)
+    {
+        depth_range(depth.row(y) + (size_t)x_min * samples, (x_max - x_min + 1) * samples, lo, hi);
+    }
+    hiz[tile] = {lo, hi, true, 0};
+}
+
+// The depth samples of a tile as floats: the depth buffer for Float32, else the scratch rows of participant,
+// still empty
+rst::rasterizer::depth_rows rst::rasterizer::open_tile_depth(int tile, int participant)
+{
+    size_t stride = (size_t)width * samples;
+    if (depth_fmt == depth_format::Float32)
+    {
+        return {depth_buf.data(), height - 1, stride};
+    }
+    int y_min = (tile / tiles_x) * tile_size;
+    return {depth_scratch[participant].data(), std::min(y_min + tile_size, height) - 1, stride};
+}
+
+// Unpacks the pixels x1..x2, y1..y2 of the tile into its scratch rows, as far as they are not yet. What is
+// unpacked stays one rectangle, grown to the bounding box of the old one and the new pixels. A pending
+// depth clear is carried out on the scratch rows, store_tile_depth writes it to the buffer.
+void rst::rasterizer::load_tile_depth(int tile, depth_rows& depth, int x1, int y1, int x2, int y2)
+{
+    if (depth_fmt == depth_format::Float32)
+    {
+        return;
+    }
+    bool empty = depth.x1 > depth.x2;
+    if (empty)
+    {
+        depth.cleared = (tile_clears[tile] & clear_depth) != 0;
+        tile_clears[tile] &= ~clear_depth;
+    }
+    else
+    {
+        if (x1 >= depth.x1 && x2 <= depth.x2 && y1 >= depth.y1 && y2 <= depth.y2)
+        {
+            return;
+        }
+        x1 = std::min(x1, depth.x1);
+        y1 = std::min(y1, depth.y1);
+        x2 = std::max(x2, depth.x2);
+        y2 = std::max(y2, depth.y2);
+    }
+
+    for (int y = y1; y <= y2; ++y)
+    {
+        if (empty || y < depth.y1 || y > depth.y2)
+        {
+            unpack_depth_span(depth, x1, x2, y);
+            continue;
+        }
+        if (x1 < depth.x1)
+        {
+            unpack_depth_span(depth, x1, depth.x1 - 1, y);
+        }
+        if (x2 > depth.x2)
+        {
+            unpack_depth_span(depth, depth.x2 + 1, x2, y);
+        }
+    }
+    depth.x1 = x1;
+    depth.y1 = y1;
+    depth.x2 = x2;
+    depth.y2 = y2;
+}
+
+void rst::rasterizer::unpack_depth_span(const depth_rows& depth, int x1, int x2, int y)
+{
+    float* row = depth.row(y) + (size_t)x1 * samples;
+    size_t count = (size_t)(x2 - x1 + 1) * samples;
+    if (depth.cleared)
+    {
+        fill_pixels((unsigned char*)row, count, &cleared_depth, sizeof(float), false);
+        return;
+    }
+    size_t first = (size_t)get_index(x1, y) * samples;
+    unpack_depth(depth_fmt, reversed, &packed_depth[first * bytes_per_depth(depth_fmt)], count, row);
+}
+
+// Write what load_tile_depth unpacked back to the depth buffer, unless only translucent triangles, which
+// leave the depth as it was, were drawn into it. If that was a pending clear, the rest of the tile is
+// cleared as well.
+void rst::rasterizer::store_tile_depth(int tile, const depth_rows& depth)
+{
+    if (depth_fmt == depth_format::Float32 || depth.x1 > depth.x2 || (blend != blend_mode::Opaque && !depth.cleared))
+    {
+        return;
+    }
+    int x_min = (tile % tiles_x) * tile_size;
+    int y_min = (tile / tiles_x) * tile_size;
+    int x_max = std::min(x_min + tile_size, width) - 1;
+    int y_max = std::min(y_min + tile_size, height) - 1;
+    int bytes = bytes_per_depth(depth_fmt);
+    unsigned char far_value[4];
+    pack_depth(depth_fmt, reversed, &cleared_depth, 1, far_value);
+    auto clear_span = [&](int x1, int x2, int y) {
+        if (x1 <= x2)
+        {
+            size_t first = (size_t)get_index(x1, y) * samples;
+            fill_pixels(&packed_depth[first * bytes], (size_t)(x2 - x1 + 1) * samples, far_value, bytes, false);
+        }
+    };
+
+    for (int y = depth.cleared ? y_min : depth.y1; y <= (depth.cleared ? y_max : depth.y2); ++y)
+    {
+        if (y < depth.y1 || y > depth.y2)
+        {
+            clear_span(x_min, x_max, y);
+            continue;
+        }
+        if (depth.cleared)
+        {
+            clear_span(x_min, depth.x1 - 1, y);
+            clear_span(depth.x2 + 1, x_max, y);
+        }
+        size_t first = (size_t)get_index(depth.x1, y) * samples;
+        pack_depth(depth_fmt, reversed, depth.row(y) + (size_t)depth.x1 * samples,
+                   (size_t)(depth.x2 - depth.x1 + 1) * samples, &packed_depth[first * bytes]);
+    }
+
+    // Rounding keeps the order of depths, so the tile's range rounded the same way still bounds what it holds
+    float range[2] = {hiz[tile].z_min, hiz[tile].z_max};
+    unsigned char packed[8];
+    pack_depth(depth_fmt, reversed, range, 2, packed);
+    unpack_depth(depth_fmt, reversed, packed, 2, range);
+    hiz[tile].z_min = range[0];
+    hiz[tile].z_max = range[1];
+}
+
+// Depth buffer for the format and sample count, cleared
+void rst::rasterizer::allocate_depth()
+{
+    size_t count = (size_t)width * height * samples;
+    cleared_depth = far_depth(depth_fmt, reversed);
+    if (depth_fmt == depth_format::Float32)
+    {
+        depth_buf.assign(count, cleared_depth);
+        std::vector<unsigned char>().swap(packed_depth);
+    }
+    else
+    {
+        std::vector<float>().swap(depth_buf);
+        int bytes = bytes_per_depth(depth_fmt);
+        unsigned char clear_value[4];
+        pack_depth(depth_fmt, reversed, &cleared_depth, 1, clear_value);
+        packed_depth.resize(count * bytes);
+        fill_pixels(packed_depth.data(), count, clear_value, bytes, false);
+    }
+    size_depth_scratch();
+    for (auto& t : tile_clears)
+    {
+        t &= ~clear_depth;
+    }
+    std::fill(hiz.begin(), hiz.end(), tile_depth{cleared_depth, cleared_depth});
+}
+
+// Scratch rows for every thread that rasterizes tiles, only needed by the compact formats
+void rst::rasterizer::size_depth_scratch()
+{
+    if (depth_fmt == depth_format::Float32)
+    {
+        std::vector<std::vector<float>>().swap(depth_scratch);
+        return;
+    }
+    depth_scratch.resize(thread_count());
+    for (auto& rows : depth_scratch)
+    {
+        rows.resize((size_t)tile_size * width * samples);
+    }
+}
+
+void rst::rasterizer::set_depth_format(depth_format format)
+{
+    if (bytes_per_depth(format) == 0)
+    {
+        throw std::runtime_error("Unknown depth format!");
+    }
+    depth_fmt = format;
+    allocate_depth();
+}
+
+void rst::rasterizer::set_reversed_z(bool enable)
+{
+    reversed = enable;
+    allocate_depth();
+}
+
+void rst::rasterizer::set_blend(blend_mode mode, float alpha)
+{
+    if (mode < blend_mode::Opaque || mode > blend_mode::OrderIndependent)
+    {
+        throw std::runtime_error("Unknown blend mode!");
+    }
+    if (!(alpha >= 0 && alpha <= 1))
+    {
+        throw std::runtime_error("Blend alpha must lie in 0..1!");
+    }
+    blend = mode;
+    blend_alpha = alpha;
+    if (mode == blend_mode::OrderIndependent && oit_buf.empty())
+    {
+        // Nothing to composite yet; the first order-independent draw into a tile clears its accumulators
+        oit_buf.resize((size_t)width * height);
+        for (auto& t : tile_clears)
+        {
+            t |= clear_oit;
+        }
+    }
 }
 
-rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+void rst::rasterizer::set_frame_count(int count)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
-
-    return {id};
+    wait_frames();
+    frames = std::make_unique<frame_ring>(width, height, fmt, count);
+    // The clears still owed to the open frame go with it
+    for (auto& t : tile_clears)
+    {
+        t &= ~clear_frame;
+    }
+    frames->set_consumer(frame_consumer);
+    frame_open = false;
+    begin_frame();
 }
 
-rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
+void rst::rasterizer::set_frame_consumer(std::function<void(const frame&)> consumer)
 {
-    auto id = get_next_id();
-    col_buf.emplace(id, cols);
+    frame_consumer = std::move(consumer);
+    frames->set_consumer(frame_consumer);
+}
 
-    return {id};
+void rst::rasterizer::begin_frame()
+{
+    if (!frame_open)
+    {
+        frame_buf = frames->acquire().data();
+        frame_open = true;
+#if RST_STATS
+        std::uint64_t frame = current_stats.frame;
+        current_stats = frame_stats();
+        current_stats.frame = frame;
+        current_stats.start_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - stats_epoch).count();
+        tile_counters.assign(thread_count(), pipeline_counters());
+#endif
+        // Ids of the last frame refer to triangles that are gone now
+        if (deferred_mode)
+        {
+            for (auto& t : tile_clears)
+            {
+                t |= clear_ids;
+            }
+            deferred_tris.clear();
+            draw_varyings.clear();
+            varyings.clear();
+            shaded_ids = 0;
+        }
+    }
 }
 
-auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
+void rst::rasterizer::end_frame()
 {
-    return Vector4f(v3.x(), v3.y(), v3.z(), w);
+    begin_frame();
+    resolve();
+#if RST_STATS
+    for (auto& c : tile_counters)
+    {
+        current_stats.counters.add(c);
+    }
+    double now = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - stats_epoch).count();
+    current_stats.frame_ms = (now - current_stats.start_us) * 1e-3;
+    last_stats = std::move(current_stats);
+    current_stats.frame = last_stats.frame + 1;
+#endif
+    frames->submit();
+    frame_open = false;
 }
 
+std::vector<unsigned char>& rst::rasterizer::frame_buffer()
+{
+    if (frame_open)
+    {
+        resolve();
+    }
+    return frames->current();
+}
 
-static bool insideTriangle(int x, int y, const Vector3f* _v)
-{   //βΪһ,ÿԪΪһά
-    Eigen::Vector3f p;
-    p << x, y,1;
+void rst::rasterizer::wait_frames()
+{
+    frames->wait_idle();
+}
 
-    Eigen::Vector3f AB = _v[1]-_v[0];
-    Eigen::Vector3f BC = _v[2]-_v[1];
-    Eigen::Vector3f CA = _v[0]-_v[2];
+void rst::rasterizer::set_thread_count(int count)
+{
+    if (count <= 0)
+    {
+        count = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    if (count == 1)
+    {
+        pool.reset();
+    }
+    else if (!pool || pool->size() != count)
+    {
+        pool = std::make_unique<thread_pool>(count);
+    }
+    size_depth_scratch();
+    RST_STAT(tile_counters.resize(count));
+}
 
-    Eigen::Vector3f AP = p - _v[0];
-    Eigen::Vector3f BP = p - _v[1];
-    Eigen::Vector3f CP = p - _v[2];
-     
-    //X1*Y2-X2*Y1ɼ˺Zֵ,ԴжZķǷһ
-    if((AB[0] * AP[1] - AB[1] * AP[0] > 0
-        && BC[0] * BP[1] - BC[1] * BP[0] > 0
-        && CA[0] * CP[1] - CA[1] * CP[0] > 0)
-        ||
-        (AB[0] * AP[1] - AB[1] * AP[0] < 0
-        && BC[0] * BP[1] - BC[1] * BP[0] < 0
-        && CA[0] * CP[1] - CA[1] * CP[0] < 0))return 1;
-    else return 0;
+int rst::rasterizer::thread_count() const
+{
+    return pool ? pool->size() : 1;
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector3f* v)
+void rst::rasterizer::set_simd_level(simd_level level)
 {
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+    simd = std::min(level, detect_simd_level());
+    span_fill = get_span_kernel(simd, pixel_bytes);
+    id_fill = get_span_kernel(simd, sizeof(std::uint32_t));
 }
 
-void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
+void rst::rasterizer::set_deferred(bool enable)
 {
-    auto& buf = pos_buf[pos_buffer.pos_id];
-    auto& ind = ind_buf[ind_buffer.ind_id];
-    auto& col = col_buf[col_buffer.col_id];
+    deferred_mode = enable;
+    if (enable)
+    {
+        id_buf.assign((size_t)width * height, 0);
+    }
+    else
+    {
+        std::vector<std::uint32_t>().swap(id_buf);
+        deferred_tris.clear();
+        draw_varyings.clear();
+        deferred_pending = false;
+        shaded_ids = 0;
+    }
+}
 
-    float f1 = (50 - 0.1) / 2.0;
-    float f2 = (50 + 0.1) / 2.0;
+rst::visible_triangle rst::rasterizer::pick(int x, int y) const
+{
+    if (id_buf.empty())
+    {
+        throw std::runtime_error("Picking needs the visibility buffer of the deferred mode!");
+    }
+    if (x < 0 || x >= width || y < 0 || y >= height)
+    {
+        throw std::runtime_error("Pixel (" + std::to_string(x) + ", " + std::to_string(y) + ") is off screen");
+    }
+    size_t ind = (size_t)(height - 1 - y) * width + x;
+    std::uint32_t id = id_buf[ind];
+    if (id == 0 || tile_clears[(y / tile_size) * tiles_x + x / tile_size] & clear_ids)
+    {
+        return {};
+    }
+    const deferred_triangle& d = deferred_tris[id - 1];
+    float depth;
+    if (depth_fmt == depth_format::Float32)
+    {
+        depth = depth_buf[ind];
+    }
+    else
+    {
+        unpack_depth(depth_fmt, reversed, &packed_depth[ind * bytes_per_depth(depth_fmt)], 1, &depth);
+    }
+    return {d.draw, d.primitive, depth};
+}
 
-    Eigen::Matrix4f mvp = projection * view * model;
-    for (auto& i : ind)
+rst::visibility_stats rst::rasterizer::visibility() const
+{
+    if (id_buf.empty())
+    {
+        throw std::runtime_error("Visibility statistics need the visibility buffer of the deferred mode!");
+    }
+    visibility_stats stats;
+    stats.draw_pixels.assign(draw_varyings.size(), 0);
+    std::vector<char> seen(deferred_tris.size(), 0);
+    for (int tile = 0; tile < (int)tile_clears.size(); ++tile)
     {
-        Triangle t;
-        Eigen::Vector4f v[] = {
-                mvp * to_vec4(buf[i[0]], 1.0f),
-                mvp * to_vec4(buf[i[1]], 1.0f),
-                mvp * to_vec4(buf[i[2]], 1.0f)
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec /= vec.w();
+        // Nothing was drawn into a tile whose ids are still to be cleared
+        if (tile_clears[tile] & clear_ids)
+        {
+            continue;
         }
-        //Viewport transformation
-        for (auto & vert : v)
+        int x_min = (tile % tiles_x) * tile_size;
+        int y_min = (tile / tiles_x) * tile_size;
+        int x_max = std::min(x_min + tile_size, width) - 1;
+        int y_max = std::min(y_min + tile_size, height) - 1;
+        for (int y = y_min; y <= y_max; ++y)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            const std::uint32_t* row = &id_buf[(size_t)(height - 1 - y) * width];
+            for (int x = x_min; x <= x_max; ++x)
+            {
+                std::uint32_t id = row[x];
+                if (id != 0)
+                {
+                    ++stats.covered_pixels;
+                    ++stats.draw_pixels[deferred_tris[id - 1].draw];
+                    seen[id - 1] = 1;
+                }
+            }
         }
+    }
 
-        for (int i = 0; i < 3; ++i)
+    // The parts a clipped triangle was split into follow each other and count once
+    const deferred_triangle* last = nullptr;
+    for (size_t i = 0; i < deferred_tris.size(); ++i)
+    {
+        const deferred_triangle& d = deferred_tris[i];
+        if (seen[i] && !(last && last->draw == d.draw && last->primitive == d.primitive))
+        {
+            ++stats.visible_triangles;
+            last = &d;
+        }
+    }
+    return stats;
+}
+
+void rst::rasterizer::reshade_draw(int draw, int count, span_shade_fn shade, const void* shader)
+{
+    if (id_buf.empty() || !frame_open)
+    {
+        throw std::runtime_error("Reshading needs the visibility buffer of an open frame in deferred mode!");
+    }
+    if (draw < 0 || draw >= (int)draw_varyings.size())
+    {
+        throw std::runtime_error("No draw call " + std::to_string(draw) + " in this frame");
+    }
+    if (count > draw_varyings[draw])
+    {
+        throw std::runtime_error("Draw call " + std::to_string(draw) + " only has " + std::to_string(draw_varyings[draw]) + " varyings");
+    }
+
+    // Shade the rest of the frame first, so the pending pass does not overwrite the new colours later
+    resolve();
+    if (pool)
+    {
+        pool->parallel_for((int)tile_bins.size(), [&](int tile, int) { shade_tile(tile, draw, shade, shader); });
+    }
+    else
+    {
+        for (int tile = 0; tile < (int)tile_bins.size(); ++tile)
         {
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
+            shade_tile(tile, draw, shade, shader);
         }
+    }
+}
 
-        auto col_x = col[i[0]];
-        auto col_y = col[i[1]];
-        auto col_z = col[i[2]];
+void rst::rasterizer::set_streaming_clears(bool enable)
+{
+    streaming_clears = enable;
+}
+
+void rst::rasterizer::set_cull(Cull mode)
+{
+    cull = mode;
+}
 
-        t.setColor(0, col_x[0], col_x[1], col_x[2]);
-        t.setColor(1, col_y[0], col_y[1], col_y[2]);
-        t.setColor(2, col_z[0], col_z[1], col_z[2]);
+void rst::rasterizer::set_depth_clip(bool enable)
+{
+    clipping.depth = enable;
+}
 
-        rasterize_triangle(t);
+void rst::rasterizer::set_tile_size(int size)
+{
+    if (size <= 0)
+    {
+        throw std::runtime_error("Tile size must be positive!");
+    }
+    // Pending clears are kept per tile of the old size
+    flush_clears(clear_all | clear_oit);
+    tile_size = size;
+    tiles_x = (width + tile_size - 1) / tile_size;
+    tiles_y = (height + tile_size - 1) / tile_size;
+    tile_bins.assign(tiles_x * tiles_y, {});
+    tile_clears.assign(tiles_x * tiles_y, 0);
+    size_depth_scratch();
+    hiz.assign(tiles_x * tiles_y, tile_depth{});
+    for (int tile = 0; tile < (int)hiz.size(); ++tile)
+    {
+        depth_rows depth = open_tile_depth(tile, 0);
+        update_tile_depth(tile, depth);
     }
 }
 
-//Screen space rasterization
-void rst::rasterizer::rasterize_triangle(const Triangle& t) {
-    auto v = t.toVector4();
-    float x1 = std::min(v[0][0], std::min(v[1][0], v[2][0]));
-    float x2 = std::max(v[0][0], std::max(v[1][0], v[2][0]));
-    float y1 = std::min(v[0][1], std::min(v[1][1], v[2][1]));
-    float y2 = std::max(v[0][1], std::max(v[1][1], v[2][1]));
-    //εx,y,Сֱֵ,תΪ
-    x1 = (int)std::floor(x1);
-    x2 = (int)std::ceil(x2);
-    y1 = (int)std::floor(y1);
-    y2 = (int)std::ceil(y2);
-
-    int SS = 0;
-    if (SS==1) {
-        std::vector<Eigen::Vector2f> pos
-        {
-            {0.25,0.25},
-            {0.75,0.25},
-            {0.25,0.75},
-            {0.75,0.75},
-        };
-        for (int x = x1; x <= x2; x++) {
-            for (int y = y1; y <=y2; y++) {
-                // ¼ǰصС
-                float minDepth = FLT_MAX;
-                int count = 0;//¼һжٵ
-                for (int i = 0; i < 4; i++) {
-                    //жСǷ
-                    if (insideTriangle((float)x + pos[i][0], (float)y + pos[i][1], t.v)) {
-                        auto tup = computeBarycentric2D((float)x + pos[i][0], (float)y + pos[i][1], t.v);
-                        float alpha;
-                        float beta;
-                        float gamma;
-                        std::tie(alpha, beta, gamma) = tup;
-                        float w_reciprocal = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                        float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                        z_interpolated *= w_reciprocal;
-                        //һĸĲͬȸ¸صС
-                        minDepth = std::min(minDepth, z_interpolated);
-                        count++;
-                     //ڼõӦ
-                    }
+// Deferred pass: depth test as usual, but the triangle's id goes to the G-buffer instead of a colour
+void rst::rasterizer::rasterize_ids(const triangle_setup& s, std::uint32_t id, int x_min, int y_min, int x_max, int y_max, const depth_rows& depth, bool depth_test) {
+    int x1 = std::max(s.x_min, x_min);
+    int x2 = std::min(s.x_max, x_max);
+    int y1 = std::max(s.y_min, y_min);
+    int y2 = std::min(s.y_max, y_max);
+    if (x1 > x2 || y1 > y2) {
+        return;
+    }
+    RST_STAT(thread_counters->pixels_tested += (std::uint64_t)(x2 - x1 + 1) * (y2 - y1 + 1));
+    for (int y = y1; y <= y2; y++) {
+        int row = get_index(0, y);
+        id_fill(s, x1, x2, (float)y + 0.5f, depth.row(y), (unsigned char*)&id_buf[row], &id, depth_test);
+    }
+}
+
+// Shade the visible pixels of a tile from the G-buffer, one call per run of pixels showing the same triangle.
+// With draw >= 0 only the pixels of that draw call are shaded, by shade instead of their own shader,
+// otherwise those of the triangles no earlier pass has shaded.
+void rst::rasterizer::shade_tile(int tile, int draw, span_shade_fn shade, const void* shader)
+{
+    if (tile_clears[tile] & clear_ids)
+    {
+        return;
+    }
+    int x_min = (tile % tiles_x) * tile_size;
+    int y_min = (tile / tiles_x) * tile_size;
+    int x_max = std::min(x_min + tile_size, width) - 1;
+    int y_max = std::min(y_min + tile_size, height) - 1;
+
+    for (int y = y_min; y <= y_max; ++y)
+    {
+        int row = get_index(0, y);
+        for (int x = x_min; x <= x_max; ++x)
+        {
+            std::uint32_t id = id_buf[row + x];
+            if (id == 0 || (draw < 0 && id <= shaded_ids))
+            {
+                continue;
+            }
+            int end = x;
+            while (end < x_max && id_buf[row + end + 1] == id)
+            {
+                ++end;
+            }
+
+            const deferred_triangle& d = deferred_tris[id - 1];
+            unsigned char* out = &frame_buf[(size_t)(row + x) * pixel_bytes];
+            if (draw >= 0)
+            {
+                if (d.draw == draw)
+                {
+                    shade(shader, varyings[d.varying], x, end, y, fmt, pixel_bytes, out);
                 }
-                //һصĸСִ
-                if (count>0) {
-                    //ݵǰصĲֵ뻺ԱȵĽлĸºɫ޸
-                    if (depth_buf[get_index(x, y)] > minDepth) {
-                        Vector3f color = t.getColor() * count / 4.0;
-                        Vector3f point(3);
-                        point << (float)x, (float)y, minDepth;
-                        depth_buf[get_index(x, y)] = minDepth;
-                        set_pixel(point, color);
-                    }
+            }
+            else if (d.shade)
+            {
+                d.shade(d.shader, varyings[d.varying], x, end, y, fmt, pixel_bytes, out);
+            }
+            else
+            {
+                for (int k = x; k <= end; ++k, out += pixel_bytes)
+                {
+                    std::memcpy(out, d.pixel, pixel_bytes);
                 }
             }
+            x = end;
+        }
+    }
+}
+
+//Screen space rasterization, limited to the pixels [x_min, x_max] x [y_min, y_max].
+void rst::rasterizer::rasterize_triangle(const Triangle& t, const triangle_setup& s, const varying_setup* v, int x_min, int y_min, int x_max, int y_max, const depth_rows& depth, bool depth_test) {
+    int x1 = std::max(s.x_min, x_min);
+    int x2 = std::min(s.x_max, x_max);
+    int y1 = std::max(s.y_min, y_min);
+    int y2 = std::min(s.y_max, y_max);
+    if (x1 > x2 || y1 > y2) {
+        return;
+    }
+    RST_STAT(thread_counters->pixels_tested += (std::uint64_t)(x2 - x1 + 1) * (y2 - y1 + 1) * samples);
+
+    Vector3f color = t.getColor();
+
+    // Interpolated colours, shaders and blending are evaluated per pixel, which the span kernels cannot do
+    if (samples > 1 || v || blend != blend_mode::Opaque) {
+        rasterize_samples(s, v, x1, y1, x2, y2, color, depth, depth_test);
+    }
+    else {
+        unsigned char pixel[16];
+        encode_pixel(fmt, color, pixel);
+        for (int y = y1; y <= y2; y++) {
+            int row = get_index(0, y);
+            span_fill(s, x1, x2, (float)y + 0.5f, depth.row(y), &frame_buf[row * pixel_bytes], pixel, depth_test);
+        }
+    }
+}
+
+// Colour of a triangle of a single colour, already in the frame's pixel format
+struct flat_shade
+{
+    static constexpr bool flat = true;
+    const unsigned char* pixel;
+    Eigen::Vector4f color;
+
+    const unsigned char* operator()(int) const { return pixel; }
+    Eigen::Vector4f rgba(int) const { return color; }
+};
+
+// Colour interpolated from the vertex colours along one row, encoded on demand
+struct color_shade
+{
+    static constexpr bool flat = false;
+    rst::varying_row row;
+    rst::pixel_format fmt;
+    mutable unsigned char pixel[16];
+
+    const unsigned char* operator()(int x) const
+    {
+        float c[3];
+        row.at(x, c);
+        rst::encode_pixel(fmt, Eigen::Vector3f(c[0], c[1], c[2]), pixel);
+        return pixel;
+    }
+
+    Eigen::Vector4f rgba(int x) const
+    {
+        float c[3];
+        row.at(x, c);
+        return {c[0], c[1], c[2], 1.0f};
+    }
+};
+
+// Multisampled rasterization: coverage and depth are evaluated per sample, colour once per pixel.
+// Also draws single sampled triangles whose colour is interpolated.
+void rst::rasterizer::rasterize_samples(const triangle_setup& s, const varying_setup* v, int x1, int y1, int x2, int y2, const Eigen::Vector3f& color, const depth_rows& depth, bool depth_test)
+{
+    const int n = samples;
+    sample_setup ss;
+    for (int e = 0; e < 3; ++e)
+    {
+        for (int k = 0; k < n; ++k)
+        {
+            ss.edge_offset[e][k] = s.edge_a[e] * sample_x[k] + s.edge_b[e] * sample_y[k];
         }
+        // Samples lie within half a pixel of the centre
+        ss.reach[e] = 0.5f * (std::abs(s.edge_a[e]) + std::abs(s.edge_b[e]));
+    }
+    for (int k = 0; k < n; ++k)
+    {
+        ss.z_offset[k] = s.z_a * sample_x[k] + s.z_b * sample_y[k];
+    }
+
+    // Colour and depth of the pixels go to the sample buffer with MSAA and straight to the frame without.
+    // Order-independent fragments go to their accumulators instead.
+    blend_state b{blend, blend_alpha, reversed ? 1.0f : 0.0f};
+    oit_pixel* oit = blend == blend_mode::OrderIndependent ? oit_buf.data() : nullptr;
+    raster_target target{depth.data, n > 1 ? sample_buf.data() : frame_buf, width, height, n, pixel_bytes, fmt, depth.top,
+                         blend == blend_mode::Opaque ? nullptr : &b, oit};
+    if (shader_fn) {
+        shader_fn(shader_obj, target, s, ss, *v, x1, y1, x2, y2, depth_test);
+    }
+    else if (!v) {
+        unsigned char pixel[16];
+        encode_pixel(fmt, color, pixel);
+        Eigen::Vector4f rgba(color.x(), color.y(), color.z(), 1.0f);
+        auto row_shade = [&](int, float) { return flat_shade{pixel, rgba}; };
+        rasterize_rows<flat_shade>(target, s, ss, x1, y1, x2, y2, row_shade, depth_test);
     }
     else {
-        for (int x = x1; x <= x2; x++) {
-            for (int y = y1; y <= y2; y++) {
-                if (insideTriangle((float)x + 0.5, (float)y + 0.5, t.v)) {
-                    auto tup = computeBarycentric2D((float)x + 0.5, (float)y + 0.5, t.v);
-                    float alpha;
-                    float beta;
-                    float gamma;
-                    std::tie(alpha, beta, gamma) = tup;
-                    float w_reciprocal = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                    float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                    z_interpolated *= w_reciprocal;
-                    //ڼõӦĲֵ
-                    //ݵǰֵ뻺ԱȵĽлĸºɫ޸
-                    if (depth_buf[get_index(x, y)] > z_interpolated) {
-                        Vector3f color = t.getColor();
-                        Vector3f point(3);
-                        point << (float)x, (float)y, z_interpolated;
-                        depth_buf[get_index(x, y)] = z_interpolated;
-                        set_pixel(point, color);
+        auto row_shade = [this, v](int, float sy) { return color_shade{varying_row(*v, 0x7, sy), fmt, {}}; };
+        rasterize_rows<color_shade>(target, s, ss, x1, y1, x2, y2, row_shade, depth_test);
+    }
+}
+
+void rst::rasterizer::set_msaa(int count)
+{
+    // Standard sample positions in 1/16 pixel units, with y flipped because our y axis points up
+    static const int pattern2[][2] = {{4, 4}, {-4, -4}};
+    static const int pattern4[][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+    static const int pattern8[][2] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+    static const int pattern16[][2] = {{1, 1}, {-1, -3}, {-3, 2}, {4, -1}, {-5, -2}, {2, 5}, {5, 3}, {3, -5},
+                                       {-2, 6}, {0, -7}, {-4, -6}, {-6, 4}, {-8, 0}, {7, -4}, {6, 7}, {-7, -8}};
+    const int (*pattern)[2] = nullptr;
+    switch (count)
+    {
+    case 1: break;
+    case 2: pattern = pattern2; break;
+    case 4: pattern = pattern4; break;
+    case 8: pattern = pattern8; break;
+    case 16: pattern = pattern16; break;
+    default:
+        throw std::runtime_error("MSAA supports 1, 2, 4, 8 or 16 samples!");
+    }
+
+    samples = count;
+    for (int k = 0; k < count; ++k)
+    {
+        sample_x[k] = pattern ? pattern[k][0] / 16.0f : 0.0f;
+        sample_y[k] = pattern ? -pattern[k][1] / 16.0f : 0.0f;
+    }
+
+    allocate_depth();
+    if (samples > 1)
+    {
+        sample_buf.resize((size_t)width * height * samples * pixel_bytes);
+        clear(Buffers::Color);
+    }
+    else
+    {
+        std::vector<unsigned char>().swap(sample_buf);
+    }
+}
+
+// Average the samples of every pixel into the current render target
+void rst::rasterizer::resolve()
+{
+    RST_STAT(stage_timer timer(current_stats, pipeline_stage::Resolve, stats_epoch));
+    if (deferred_pending)
+    {
+        shade_deferred();
+    }
+
+    if (samples > 1 && samples_dirty)
+    {
+        if (pool)
+        {
+            pool->parallel_for((int)tile_bins.size(), [this](int tile, int) { resolve_tile(tile); });
+        }
+        else
+        {
+            for (int tile = 0; tile < (int)tile_bins.size(); ++tile)
+            {
+                resolve_tile(tile);
+            }
+        }
+        samples_dirty = false;
+    }
+
+    if (!oit_buf.empty())
+    {
+        if (pool)
+        {
+            pool->parallel_for((int)tile_bins.size(), [this](int tile, int) { composite_tile(tile); });
+        }
+        else
+        {
+            for (int tile = 0; tile < (int)tile_bins.size(); ++tile)
+            {
+                composite_tile(tile);
+            }
+        }
+    }
+
+    // Tiles nothing was drawn into still owe the render target their clear
+    flush_clears(clear_frame);
+}
+
+// Shade the pixels of the triangles drawn into the G-buffer since the last pass
+void rst::rasterizer::shade_deferred()
+{
+    if (pool)
+    {
+        pool->parallel_for((int)tile_bins.size(), [this](int tile, int) { shade_tile(tile, -1, nullptr, nullptr); });
+    }
+    else
+    {
+        for (int tile = 0; tile < (int)tile_bins.size(); ++tile)
+        {
+            shade_tile(tile, -1, nullptr, nullptr);
+        }
+    }
+    shaded_ids = (std::uint32_t)deferred_tris.size();
+    deferred_pending = false;
+}
+
+// Composite the order-independent fragments of a tile over its pixels in the render target and mark its
+// accumulators for clearing
+void rst::rasterizer::composite_tile(int tile)
+{
+    if (tile_clears[tile] & clear_oit)
+    {
+        return;
+    }
+    int x_min = (tile % tiles_x) * tile_size;
+    int y_min = (tile / tiles_x) * tile_size;
+    int x_max = std::min(x_min + tile_size, width) - 1;
+    int y_max = std::min(y_min + tile_size, height) - 1;
+
+    for (int y = y_min; y <= y_max; ++y)
+    {
+        size_t row = (size_t)get_index(0, y);
+        for (int x = x_min; x <= x_max; ++x)
+        {
+            const oit_pixel& p = oit_buf[row + x];
+            if (p.weight == 0 && p.revealage == 1)
+            {
+                continue;
+            }
+            unsigned char* dst = &frame_buf[(row + x) * pixel_bytes];
+            encode_pixel(fmt, composite(p, decode_pixel(fmt, dst)), dst);
+        }
+    }
+    tile_clears[tile] |= clear_oit;
+}
+
+void rst::rasterizer::resolve_tile(int tile)
+{
+    int x_min = (tile % tiles_x) * tile_size;
+    int y_min = (tile / tiles_x) * tile_size;
+    int x_max = std::min(x_min + tile_size, width) - 1;
+    int y_max = std::min(y_min + tile_size, height) - 1;
+    const int n = samples;
+    if (tile_clears[tile] & clear_frame)
+    {
+        // Cleared and not drawn into since; flush_clears writes the clear colour
+        return;
+    }
+
+    for (int y = y_min; y <= y_max; ++y)
+    {
+        size_t row = (size_t)get_index(0, y);
+        for (int x = x_min; x <= x_max; ++x)
+        {
+            const unsigned char* src = &sample_buf[(row + x) * n * pixel_bytes];
+            unsigned char* dst = &frame_buf[(row + x) * pixel_bytes];
+
+            // Pixels away from edges hold n copies of the same colour
+            bool uniform = true;
+            for (int k = 1; k < n && uniform; ++k)
+            {
+                uniform = std::memcmp(src, src + k * pixel_bytes, pixel_bytes) == 0;
+            }
+            if (uniform)
+            {
+                std::memcpy(dst, src, pixel_bytes);
+            }
+            else if (pixel_bytes == 4)
+            {
+                // Packed 8-bit formats average each byte directly, whatever the channel order
+                unsigned sum[4] = {0, 0, 0, 0};
+                for (int k = 0; k < n; ++k)
+                {
+                    for (int c = 0; c < 4; ++c)
+                    {
+                        sum[c] += src[k * 4 + c];
                     }
                 }
+                for (int c = 0; c < 4; ++c)
+                {
+                    dst[c] = (unsigned char)((sum[c] + n / 2) / n);
+                }
+            }
+            else
+            {
+                Eigen::Vector3f sum(0, 0, 0);
+                for (int k = 0; k < n; ++k)
+                {
+                    sum += decode_pixel(fmt, src + k * pixel_bytes);
+                }
+                encode_pixel(fmt, sum / (float)n, dst);
             }
         }
     }
@@ -223,20 +1621,107 @@ void rst::rasterizer::set_projection(const Eigen::Matrix4f& p)
 
 void rst::rasterizer::clear(rst::Buffers buff)
 {
+    begin_frame();
+    RST_STAT(stage_timer timer(current_stats, pipeline_stage::Clear, stats_epoch));
+    RST_STAT(current_stats.counters.clears++);
+    std::uint8_t pending = 0;
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        pending |= clear_frame | clear_samples | clear_ids | clear_oit;
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
-        std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        pending |= clear_depth;
+        std::fill(hiz.begin(), hiz.end(), tile_depth{cleared_depth, cleared_depth});
+    }
+    for (auto& t : tile_clears)
+    {
+        t |= pending;
+    }
+}
+
+// Carry out the clears of these buffers still pending for a tile, before anything reads or draws into it
+void rst::rasterizer::touch_tile(int tile, std::uint8_t buffers, bool stream)
+{
+    std::uint8_t pending = tile_clears[tile] & buffers;
+    if (!pending)
+    {
+        return;
+    }
+    int x_min = (tile % tiles_x) * tile_size;
+    int y_min = (tile / tiles_x) * tile_size;
+    int count = std::min(x_min + tile_size, width) - x_min;
+    int y_max = std::min(y_min + tile_size, height) - 1;
+    const std::uint32_t no_id = 0;
+    int depth_bytes = bytes_per_depth(depth_fmt);
+    unsigned char far_value[4];
+    pack_depth(depth_fmt, reversed, &cleared_depth, 1, far_value);
+
+    for (int y = y_min; y <= y_max; ++y)
+    {
+        size_t first = (size_t)get_index(x_min, y);
+        if (pending & clear_frame)
+        {
+            fill_pixels(&frame_buf[first * pixel_bytes], count, clear_pixel, pixel_bytes, stream);
+        }
+        if ((pending & clear_samples) && !sample_buf.empty())
+        {
+            fill_pixels(&sample_buf[first * samples * pixel_bytes], (size_t)count * samples, clear_pixel, pixel_bytes, stream);
+        }
+        if ((pending & clear_ids) && !id_buf.empty())
+        {
+            fill_pixels((unsigned char*)&id_buf[first], count, &no_id, sizeof(no_id), stream);
+        }
+        if (pending & clear_depth)
+        {
+            unsigned char* depth = depth_buf.empty() ? &packed_depth[first * samples * depth_bytes] : (unsigned char*)&depth_buf[first * samples];
+            fill_pixels(depth, (size_t)count * samples, far_value, depth_bytes, stream);
+        }
+        if ((pending & clear_oit) && !oit_buf.empty())
+        {
+            std::fill(&oit_buf[first], &oit_buf[first] + count, oit_pixel{});
+        }
+    }
+    tile_clears[tile] &= ~pending;
+}
+
+// Carry out every pending clear of these buffers
+void rst::rasterizer::flush_clears(std::uint8_t buffers)
+{
+    if (std::none_of(tile_clears.begin(), tile_clears.end(), [buffers](std::uint8_t t) { return (t & buffers) != 0; }))
+    {
+        return;
+    }
+    bool stream = streaming_clears;
+    if (pool)
+    {
+        pool->parallel_for((int)tile_clears.size(), [this, buffers, stream](int tile, int) { touch_tile(tile, buffers, stream); });
+    }
+    else
+    {
+        for (int tile = 0; tile < (int)tile_clears.size(); ++tile)
+        {
+            touch_tile(tile, buffers, stream);
+        }
     }
 }
 
-rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
+rst::rasterizer::rasterizer(int w, int h, pixel_format format) : fmt(format), pixel_bytes(bytes_per_pixel(format)), width(w), height(h)
 {   //դĹ캯
-    frame_buf.resize(w * h);
-    depth_buf.resize(w * h);
+    frames = std::make_unique<frame_ring>(w, h, fmt, 1);
+    allocate_depth();
+    encode_pixel(fmt, Eigen::Vector3f{0, 0, 0}, clear_pixel);
+    set_tile_size(tile_size);
+    set_simd_level(detect_simd_level());
+    begin_frame();
+}
+
+rst::rasterizer::~rasterizer() noexcept(false)
+{
+    if (!std::uncaught_exception())
+    {
+        frames->finish();
+    }
 }
 
 int rst::rasterizer::get_index(int x, int y)
@@ -247,9 +1732,32 @@ int rst::rasterizer::get_index(int x, int y)
 void rst::rasterizer::set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color)
 {
     //old index: auto ind = point.y() + point.x() * width;
-    auto ind = (height-1-point.y())*width + point.x();
-    frame_buf[ind] = color;
-
+    int ind = (height-1-(int)point.y())*width + (int)point.x();
+    RST_STAT(current_stats.counters.pixel_writes++);
+    touch_tile(((int)point.y() / tile_size) * tiles_x + (int)point.x() / tile_size, clear_all, false);
+    Eigen::Vector4f rgba(color.x(), color.y(), color.z(), blend_alpha);
+    blend_mode mode = blend == blend_mode::OrderIndependent ? blend_mode::Alpha : blend;
+    auto write = [&](unsigned char* dst) {
+        if (mode == blend_mode::Opaque)
+        {
+            encode_pixel(fmt, color, dst);
+        }
+        else
+        {
+            blend_pixel(mode, fmt, rgba, dst);
+        }
+    };
+    write(&frame_buf[ind * pixel_bytes]);
+    if (!id_buf.empty())
+    {
+        // Keep the deferred pass from shading over it
+        id_buf[ind] = 0;
+    }
+    for (int k = 0; k < samples && samples > 1; ++k)
+    {
+        write(&sample_buf[((size_t)ind * samples + k) * pixel_bytes]);
+    }
+    samples_dirty = samples_dirty || samples > 1;
 }
 
 // clang-format on
\ No newline at end of file
@@ -6,8 +6,21 @@
 
 #include <Eigen/Eigen>
 #include <algorithm>
+#include <stdexcept>
+#include <string>
 #include "global.hpp"
 #include "Triangle.hpp"
+#include "thread_pool.hpp"
+#include "span_kernels.hpp"
+#include "pixel_format.hpp"
+#include "depth_format.hpp"
+#include "blending.hpp"
+#include "frame_ring.hpp"
+#include "buffer_store.hpp"
+#include "vertex_stage.hpp"
+#include "varyings.hpp"
+#include "shader.hpp"
+#include "pipeline_stats.hpp"
 using namespace Eigen;
 
 namespace rst
@@ -34,6 +47,32 @@ namespace rst
         Triangle
     };
 
+    // Which triangles to discard by their winding on screen: clockwise, counter clockwise, or none
+    enum class Cull
+    {
+        None,
+        CW,
+        CCW
+    };
+
+    // What the visibility buffer holds for a pixel: the draw call of the frame (counting from 0) and the
+    // triangle of its index buffer that is visible there, -1 for neither, and its depth
+    struct visible_triangle
+    {
+        int draw = -1;
+        int primitive = -1;
+        float depth = std::numeric_limits<float>::infinity();
+    };
+
+    // Coverage of the visibility buffer: pixels showing any triangle, pixels per draw call of the frame,
+    // and the number of different triangles visible
+    struct visibility_stats
+    {
+        int covered_pixels = 0;
+        int visible_triangles = 0;
+        std::vector<int> draw_pixels;
+    };
+
     /*
      * For the curious : The draw function takes two buffer id's as its arguments. These two structs
      * make sure that if you mix up with their orders, the compiler won't compile it.
@@ -57,27 +96,246 @@ namespace rst
     class rasterizer
     {
     public:
-        rasterizer(int w, int h);
+        // The frame buffer is stored in the given format, see pixel_format
+        rasterizer(int w, int h, pixel_format format = pixel_format::RGB32F);
+        // Waits for the frame consumer and rethrows an exception it has not reported yet, unless the
+        // rasterizer is destroyed while another exception unwinds the stack
+        ~rasterizer() noexcept(false);
         pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
         ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
         col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
 
+        // Take over the caller's vector without copying it
+        pos_buf_id load_positions(std::vector<Eigen::Vector3f>&& positions);
+        ind_buf_id load_indices(std::vector<Eigen::Vector3i>&& indices);
+        col_buf_id load_colors(std::vector<Eigen::Vector3f>&& colors);
+
+        /*
+         * Use count elements at data in place. The memory must stay valid and unchanged until the buffer
+         * is unloaded; passing an owner (e.g. the handle of a file mapping) makes the rasterizer keep it
+         * alive until then.
+         * */
+        pos_buf_id load_positions(const Eigen::Vector3f* data, size_t count, std::shared_ptr<const void> owner = nullptr);
+        ind_buf_id load_indices(const Eigen::Vector3i* data, size_t count, std::shared_ptr<const void> owner = nullptr);
+        col_buf_id load_colors(const Eigen::Vector3f* data, size_t count, std::shared_ptr<const void> owner = nullptr);
+
+        // Free a buffer; its id, and any copy of it, is invalid afterwards and draw rejects it
+        void unload(pos_buf_id id);
+        void unload(ind_buf_id id);
+        void unload(col_buf_id id);
+
+        /*
+         * View of the elements of a loaded buffer; throws for invalid ids. The elements it points at stay
+         * valid until the buffer is unloaded, loading other buffers does not move them.
+         * */
+        buffer_span<Eigen::Vector3f> get_positions(pos_buf_id id) const { return pos_buf.get(id.pos_id); }
+        buffer_span<Eigen::Vector3i> get_indices(ind_buf_id id) const { return ind_buf.get(id.ind_id); }
+        buffer_span<Eigen::Vector3f> get_colors(col_buf_id id) const { return col_buf.get(id.col_id); }
+
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
+        // Screen depth runs from the near to the far plane of the projection, see make_viewport
         void set_projection(const Eigen::Matrix4f& p);
 
+        // Writes one pixel, blended with the direct blend modes (OrderIndependent blends it like Alpha)
         void set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color);
 
+        /*
+         * Clears are carried out lazily, tile by tile: a tile is only cleared when something is first drawn
+         * into it, so sparse frames do not pay for clearing the whole screen. resolve() (so end_frame() and
+         * frame_buffer()) clears the colour of the tiles nothing was drawn into.
+         * */
         void clear(Buffers buff);
 
+        // Whether the clears resolve() carries out use non-temporal stores, which leave the cache and the
+        // memory bandwidth they would take to other threads. Off by default: writing the frame around the
+        // cache is slower whenever it would have stayed there, and it only pays when the frame is large and
+        // read by another core, e.g. by the frame consumer.
+        void set_streaming_clears(bool enable);
+
+        /*
+         * How the triangles of the following draws combine with the frame, see blend_mode; alpha multiplies
+         * the alpha of their fragments. Translucent draws test depth without writing it, so they belong
+         * after the opaque ones. Of their triangles only those blended with Alpha need to be drawn from the
+         * back to the front; the other modes do not depend on the order, up to rounding.
+         * With OrderIndependent the fragments of all draws are accumulated per pixel, tile by tile like
+         * everything else, and composited over the frame by resolve() (so end_frame()); it needs an extra
+         * 20 bytes per pixel, allocated on first use.
+         * In deferred mode translucent draws are shaded as they are drawn, over the opaque pixels before
+         * them, which the direct modes shade first.
+         * */
+        void set_blend(blend_mode mode, float alpha = 1.0f);
+        blend_mode get_blend() const { return blend; }
+        float get_blend_alpha() const { return blend_alpha; }
+
+        // Primitive::Line draws the edges of the triangles as white one pixel lines, without depth test
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        /*
+         * Draws the triangles of ind_buffer with a shader (see shader.hpp): shader.vertex runs once per
+         * vertex of pos_buffer, shader.fragment once per covered pixel, inlined into the pixel loop.
+         * The shader has to stay alive until draw returns.
+         * */
+        template <class Shader>
+        void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, const Shader& shader);
+
+        const Eigen::Matrix4f& get_model() const { return model; }
+        const Eigen::Matrix4f& get_view() const { return view; }
+        const Eigen::Matrix4f& get_projection() const { return projection; }
+
+        /*
+         * Current render target: rows from top to bottom, bytes_per_pixel(format()) bytes per pixel. An
+         * open frame is resolved first (see resolve()), so tiles cleared but not drawn into since, MSAA
+         * samples and deferred pixels are all in it.
+         * */
+        std::vector<unsigned char>& frame_buffer();
+        pixel_format format() const { return fmt; }
+
+        /*
+         * The rasterizer renders into a ring of `count` frame buffers (1 by default). begin_frame picks a
+         * free one as render target (clear and draw do so implicitly), end_frame hands it to the consumer,
+         * which runs on its own thread, so frame N + 1 is rendered while frame N is still being written
+         * out. The consumer must not keep the frame data after it returns. An exception thrown by the
+         * consumer is rethrown by the next begin_frame, end_frame or wait_frames (or the destructor).
+         * */
+        void set_frame_count(int count);
+        void set_frame_consumer(std::function<void(const frame&)> consumer);
+        void begin_frame();
+        void end_frame();
+        // Blocks until the consumer has seen every finished frame
+        void wait_frames();
+
+        /*
+         * Triangles are clipped in homogeneous space before the division, against w > 0 and against a
+         * guard band around the screen; what is left is clamped to the screen. Depth clipping to
+         * -w <= z <= w is off by default, as the projection in main.cpp does not map the visible depth
+         * range into it.
+         * */
+        void set_depth_clip(bool enable);
+
+        // Back-face culling by screen space winding, off by default. Degenerate triangles and triangles
+        // too thin to cover any sample are always dropped.
+        void set_cull(Cull mode);
+
+        // Triangles are binned into square tiles of this many pixels and rasterized tile by tile
+        void set_tile_size(int size);
+
+        // Number of threads rasterizing tiles: 1 keeps everything on the calling thread,
+        // 0 picks one per hardware thread. The image does not depend on the thread count.
+        void set_thread_count(int count);
+        int thread_count() const;
+
+        // Pixel kernel used for the spans of a triangle; defaults to the widest one the CPU supports
+        // and is clamped to it. Every level produces the same image.
+        void set_simd_level(simd_level level);
+        simd_level get_simd_level() const { return simd; }
+
+        /*
+         * Multisample anti-aliasing with 1 (off), 2, 4, 8 or 16 samples per pixel at the standard sample
+         * positions. Depth and colour are kept per sample, colour is computed once per pixel, and the
+         * samples are averaged into the render target by resolve(), which end_frame() calls.
+         * Changing the sample count discards the contents of the sample buffers.
+         * */
+        void set_msaa(int count);
+        int msaa() const { return samples; }
+        void resolve();
+
+        /*
+         * Depth is stored in the given format (see depth_format), Float32 by default. The compact formats
+         * cut the memory traffic of the depth test: the depths of a tile are unpacked to floats when the
+         * tile is rasterized and packed again when it is done, so within a draw call depth is tested at
+         * float precision and rounded to the format in between draw calls. Changing the format discards
+         * the contents of the depth buffer.
+         * */
+        void set_depth_format(depth_format format);
+        depth_format get_depth_format() const { return depth_fmt; }
+
+        /*
+         * Reversed-Z: depth runs from -1 at the near plane to 0 at the far one instead of from 0 to 1, so
+         * the far end, where perspective crowds the depths together, gets the dense float values around 0.
+         * Nearer still is smaller, so the depth test and the clears stay as they are. Only Float32 gains
+         * precision from it; the normalised formats are evenly spaced either way. Changing it discards the
+         * contents of the depth buffer.
+         * */
+        void set_reversed_z(bool enable);
+        bool reversed_z() const { return reversed; }
+
+        /*
+         * Deferred shading: draws only write depth and a triangle id per pixel, and resolve() (so
+         * end_frame()) shades each visible pixel once, tile by tile, instead of shading every fragment that
+         * passes the depth test at the time it is drawn. Shaders handed to draw must then stay alive until
+         * the frame is resolved. Only takes effect without MSAA; with it triangles are shaded as they are
+         * drawn.
+         * */
+        void set_deferred(bool enable);
+        bool deferred() const { return deferred_mode; }
+
+        /*
+         * The triangle ids of the deferred mode double as a visibility buffer. It describes the frame being
+         * drawn, or after end_frame() the last one, until the next frame begins. pick returns what is
+         * visible at pixel (x, y), visibility the coverage of the whole screen.
+         * */
+        visible_triangle pick(int x, int y) const;
+        visibility_stats visibility() const;
+
+        /*
+         * Shades the visible pixels of draw call `draw` of the open frame again, with another shader that
+         * reads no more varyings than the draw call's vertex stage wrote, without rasterizing anything.
+         * Draws without a shader hand it their vertex colours. Call before end_frame().
+         * */
+        template <class Shader>
+        void reshade(int draw, const Shader& shader);
+
+        // Counters and stage times of the last finished frame; all zero unless the build defines
+        // RST_STATS=1 (see pipeline_stats.hpp)
+        const frame_stats& stats() const { return last_stats; }
 
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
+        void rasterize_wireframe(const buffer_span<Eigen::Vector3i>& ind, size_t vertex_count);
 
-        void rasterize_triangle(const Triangle& t);
+        bool misses_samples(const Triangle& t) const;
+        viewport screen_viewport() const;
+        bool flip_w() const;
+        void assemble(const buffer_span<Eigen::Vector3i>& ind, size_t vertex_count, const float* attributes, int count);
+        void add_triangle(Triangle& t, const float inv_w[3], const float* const values[3], int count, int primitive);
+        void rasterize_draw();
+        bool deferring() const { return deferred_mode && samples == 1 && blend == blend_mode::Opaque; }
+        // Depth samples of the rows of a tile while it is rasterized: those of pixel (x, y) start at
+        // row(y) + x * samples. They are the depth buffer itself for Float32. For the compact formats they
+        // are scratch rows, into which load_tile_depth unpacks the pixels x1..x2, y1..y2 of the tile as
+        // triangles need them (none while x1 > x2); cleared tells that they were a pending clear.
+        struct depth_rows
+        {
+            float* data;
+            int top;
+            size_t stride;
+            int x1 = 0, y1 = 0, x2 = -1, y2 = -1;
+            bool cleared = false;
+
+            float* row(int y) const { return data + (size_t)(top - y) * stride; }
+        };
+
+        void allocate_depth();
+        void size_depth_scratch();
+        depth_rows open_tile_depth(int tile, int participant);
+        void load_tile_depth(int tile, depth_rows& depth, int x1, int y1, int x2, int y2);
+        void unpack_depth_span(const depth_rows& depth, int x1, int x2, int y);
+        void store_tile_depth(int tile, const depth_rows& depth);
+        void rasterize_ids(const triangle_setup& s, std::uint32_t id, int x_min, int y_min, int x_max, int y_max, const depth_rows& depth, bool depth_test);
+        void shade_tile(int tile, int draw, span_shade_fn shade, const void* shader);
+        void shade_deferred();
+        void reshade_draw(int draw, int count, span_shade_fn shade, const void* shader);
+        void bin_triangles();
+        void run_tile(int tile, int participant);
+        void touch_tile(int tile, std::uint8_t buffers, bool stream);
+        void flush_clears(std::uint8_t buffers);
+        void rasterize_tile(int tile, int participant);
+        void update_tile_depth(int tile, depth_rows& depth);
+        void rasterize_triangle(const Triangle& t, const triangle_setup& s, const varying_setup* v, int x_min, int y_min, int x_max, int y_max, const depth_rows& depth, bool depth_test);
+        void rasterize_samples(const triangle_setup& s, const varying_setup* v, int x1, int y1, int x2, int y2, const Eigen::Vector3f& color, const depth_rows& depth, bool depth_test);
+        void resolve_tile(int tile);
+        void composite_tile(int tile);
 
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
@@ -86,18 +344,173 @@ namespace rst
         Eigen::Matrix4f view;
         Eigen::Matrix4f projection;
 
-        std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-        std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> col_buf;
+        buffer_store<Eigen::Vector3f> pos_buf;
+        buffer_store<Eigen::Vector3i> ind_buf;
+        buffer_store<Eigen::Vector3f> col_buf;
 
-        std::vector<Eigen::Vector3f> frame_buf;
+        pixel_format fmt;
+        int pixel_bytes;
+        std::unique_ptr<frame_ring> frames;
+        std::function<void(const frame&)> frame_consumer;
+        unsigned char* frame_buf = nullptr;
+        bool frame_open = false;
 
+        // With MSAA the samples of a pixel are stored next to each other, pixel by pixel. Float32 depth
+        // lives in depth_buf, the compact formats in packed_depth, and while a tile is rasterized in the
+        // depth_scratch of the thread: tile_size rows of the full width, of which the tile's part is used.
         std::vector<float> depth_buf;
+        std::vector<unsigned char> packed_depth;
+        std::vector<std::vector<float>> depth_scratch;
+        depth_format depth_fmt = depth_format::Float32;
+        bool reversed = false;
+        float cleared_depth = std::numeric_limits<float>::infinity();
+        std::vector<unsigned char> sample_buf;
+        int samples = 1;
+        float sample_x[16] = {}, sample_y[16] = {};
+        bool samples_dirty = false;
         int get_index(int x, int y);
 
         int width, height;
 
-        int next_id = 0;
-        int get_next_id() { return next_id++; }
+        vertex_cache verts;
+        clip_volume clipping;
+        Cull cull = Cull::None;
+        std::vector<Triangle> screen_tris;
+        std::vector<triangle_setup> setups;
+        // Index into varyings per screen triangle, -1 for triangles of a single colour, and the triangle
+        // of the index buffer it comes from
+        std::vector<int> tri_varyings;
+        std::vector<int> tri_primitives;
+        int assembled_varyings = 0;
+        std::vector<varying_setup> varyings;
+
+        // Shader of the current draw call, if any, and the varyings its vertex stage wrote
+        shade_fn shader_fn = nullptr;
+        span_shade_fn span_shader_fn = nullptr;
+        const void* shader_obj = nullptr;
+        std::vector<float> vertex_out;
+
+        /*
+         * G-buffer of the deferred mode: per pixel the id of the visible triangle, 0 for none, and per id
+         * what shades it. Triangle i of a draw call gets id base + i + 1; its varyings stay in varyings
+         * for the whole frame, from which any pixel's values follow without storing barycentrics.
+         * draw_varyings holds the varying count of every draw call of the frame.
+         * */
+        struct deferred_triangle
+        {
+            span_shade_fn shade;
+            const void* shader;
+            int varying;
+            int draw;
+            int primitive;
+            unsigned char pixel[16];
+        };
+        bool deferred_mode = false;
+        bool deferred_pending = false;
+        std::vector<std::uint32_t> id_buf;
+        std::vector<deferred_triangle> deferred_tris;
+        std::vector<int> draw_varyings;
+        std::uint32_t deferred_base = 0;
+        // Ids up to this one were shaded by an earlier pass of the frame, which later ones leave alone
+        std::uint32_t shaded_ids = 0;
+        std::vector<std::vector<int>> tile_bins;
+        int tile_size = 64;
+        int tiles_x = 0, tiles_y = 0;
+
+        // Clears not carried out yet, per tile: its part of these buffers still holds what was there
+        // before. Colour clears set all but clear_depth, and the deferred mode clears ids every frame.
+        // clear_oit is not part of clear_all: only order-independent draws carry it out, and resolve sets
+        // it again for the fragments it composited, so tiles without any are skipped.
+        enum : std::uint8_t
+        {
+            clear_frame = 1,
+            clear_samples = 2,
+            clear_ids = 4,
+            clear_depth = 8,
+            clear_all = 15,
+            clear_oit = 16
+        };
+        std::vector<std::uint8_t> tile_clears;
+        unsigned char clear_pixel[16] = {};
+        bool streaming_clears = false;
+
+        /*
+         * Coarse depth per tile, used to reject triangles hidden behind what a tile already holds and to
+         * skip the per-pixel test for triangles in front of all of it. z_min never exceeds and z_max is
+         * never below the real extremes of the tile's depth buffer; exact tells whether they are tight and
+         * draws counts the triangles drawn since they last were.
+         * */
+        struct tile_depth
+        {
+            float z_min = std::numeric_limits<float>::infinity();
+            float z_max = std::numeric_limits<float>::infinity();
+            bool exact = true;
+            int draws = 0;
+        };
+        std::vector<tile_depth> hiz;
+
+        // Blending of the following draws, and the accumulators of the order-independent mode, rows from
+        // top to bottom
+        blend_mode blend = blend_mode::Opaque;
+        float blend_alpha = 1;
+        std::vector<oit_pixel> oit_buf;
+
+        std::unique_ptr<thread_pool> pool;
+
+        simd_level simd;
+        span_kernel span_fill;
+        span_kernel id_fill;
+
+        // Statistics of the open frame, counted by the calling thread and, per pool thread, by the tile jobs
+        frame_stats current_stats, last_stats;
+        std::vector<pipeline_counters> tile_counters;
+        std::chrono::steady_clock::time_point stats_epoch = std::chrono::steady_clock::now();
     };
+
+    template <class Shader>
+    void rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, const Shader& shader)
+    {
+        // Throws for ids that are unknown or have been unloaded
+        auto buf = pos_buf.get(pos_buffer.pos_id);
+        auto ind = ind_buf.get(ind_buffer.ind_id);
+        int count = shader.varyings();
+        if (count < 0 || count > max_varyings)
+        {
+            throw std::runtime_error("A shader passes at most " + std::to_string(max_varyings) + " varyings!");
+        }
+        begin_frame();
+        RST_STAT(current_stats.counters.draws++);
+        RST_STAT(current_stats.counters.vertices += buf.size);
+        RST_STAT(current_stats.counters.triangles += ind.size);
+
+        {
+            RST_STAT(stage_timer timer(current_stats, pipeline_stage::Vertex, stats_epoch));
+            verts.resize(buf.size);
+            vertex_out.resize(buf.size * count);
+            for (size_t i = 0; i < buf.size; ++i)
+            {
+                Eigen::Vector4f p = shader.vertex((int)i, buf[i], vertex_out.data() + i * count);
+                verts.x[i] = p.x();
+                verts.y[i] = p.y();
+                verts.z[i] = p.z();
+                verts.w[i] = p.w();
+            }
+            project_vertices(screen_viewport(), clipping, flip_w(), verts);
+        }
+
+        shader_fn = &shade_triangle<Shader>;
+        span_shader_fn = &shade_span<Shader>;
+        shader_obj = &shader;
+        assemble(ind, buf.size, vertex_out.data(), count);
+        rasterize_draw();
+        shader_fn = nullptr;
+        span_shader_fn = nullptr;
+        shader_obj = nullptr;
+    }
+
+    template <class Shader>
+    void rasterizer::reshade(int draw, const Shader& shader)
+    {
+        reshade_draw(draw, shader.varyings(), &shade_span<Shader>, &shader);
+    }
 }
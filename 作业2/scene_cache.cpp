@@ -0,0 +1,212 @@
+//
+// Binary scene cache: the vertex, index and colour buffers of a scene, mapped back in without parsing.
+//
+
+#include "scene_cache.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include "mapped_file.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+static const char sceneMagic[8] = {'R', 'S', 'T', 'S', 'C', 'E', 'N', 'E'};
+static const std::uint32_t byteOrderMark = 0x01020304;
+static const std::uint64_t arrayAlignment = 64;
+
+// The arrays are written and mapped back as packed 12 byte vectors
+static_assert(sizeof(Eigen::Vector3f) == 12 && sizeof(Eigen::Vector3i) == 12, "Vector3f and Vector3i must be packed");
+
+static std::uint64_t alignUp(std::uint64_t offset)
+{
+    return (offset + arrayAlignment - 1) / arrayAlignment * arrayAlignment;
+}
+
+// A name next to filename that no other save, in this process or another, writes at the same time
+static std::string temporaryName(const std::string& filename)
+{
+    static std::atomic<unsigned> counter{0};
+#ifdef _WIN32
+    unsigned long process = GetCurrentProcessId();
+#else
+    unsigned long process = (unsigned long)getpid();
+#endif
+    return filename + "." + std::to_string(process) + "." + std::to_string(counter++) + ".tmp";
+}
+
+// Moves from over to in one step, so that to is always either the old or the new file
+static bool replaceFile(const std::string& from, const std::string& to)
+{
+#ifdef _WIN32
+    // rename fails there if to exists
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+void rst::save_scene(const std::string& filename, const rasterizer& r, const std::vector<mesh_buffers>& meshes)
+{
+    struct arrays
+    {
+        const void* data[3];
+        std::uint64_t bytes[3];
+    };
+    std::vector<arrays> sources;
+    std::vector<scene_entry> entries(meshes.size());
+    std::uint64_t offset = sizeof(scene_header) + sizeof(scene_entry) * meshes.size();
+    for (size_t i = 0; i < meshes.size(); ++i)
+    {
+        // Throws for ids that are unknown or have been unloaded
+        auto pos = r.get_positions(meshes[i].positions);
+        auto ind = r.get_indices(meshes[i].indices);
+        auto col = r.get_colors(meshes[i].colors);
+        sources.push_back({{pos.data, ind.data, col.data}, {pos.size * 12, ind.size * 12, col.size * 12}});
+
+        scene_entry& e = entries[i];
+        std::memset(&e, 0, sizeof(e));
+        std::uint64_t* fields[3][2] = {{&e.positions, &e.position_count}, {&e.indices, &e.index_count}, {&e.colors, &e.color_count}};
+        std::uint64_t counts[3] = {pos.size, ind.size, col.size};
+        for (int k = 0; k < 3; ++k)
+        {
+            offset = alignUp(offset);
+            *fields[k][0] = offset;
+            *fields[k][1] = counts[k];
+            offset += sources.back().bytes[k];
+        }
+    }
+
+    scene_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, sceneMagic, sizeof(sceneMagic));
+    header.version = scene_cache_version;
+    header.byte_order = byteOrderMark;
+    header.mesh_count = (std::uint32_t)meshes.size();
+
+    // Readers never see a half written cache: it is written next to the target and renamed over it
+    std::string temporary = temporaryName(filename);
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            throw std::runtime_error("Cannot write " + temporary);
+        }
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)entries.data(), sizeof(scene_entry) * entries.size());
+        std::uint64_t written = sizeof(scene_header) + sizeof(scene_entry) * entries.size();
+        static const char padding[arrayAlignment] = {};
+        for (auto& a : sources)
+        {
+            for (int k = 0; k < 3; ++k)
+            {
+                out.write(padding, (std::streamsize)(alignUp(written) - written));
+                out.write((const char*)a.data[k], (std::streamsize)a.bytes[k]);
+                written = alignUp(written) + a.bytes[k];
+            }
+        }
+        out.close();
+        if (!out)
+        {
+            std::remove(temporary.c_str());
+            throw std::runtime_error("Cannot write " + temporary);
+        }
+    }
+    if (!replaceFile(temporary, filename))
+    {
+        std::remove(temporary.c_str());
+        throw std::runtime_error("Cannot replace " + filename);
+    }
+}
+
+std::vector<rst::mesh_buffers> rst::load_scene(rasterizer& r, const std::string& filename)
+{
+    auto file = std::make_shared<mapped_file>(filename);
+    const char* data = file->data();
+    std::uint64_t size = file->size();
+
+    scene_header header;
+    if (size < sizeof(header))
+    {
+        throw std::runtime_error(filename + " is not a scene cache");
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, sceneMagic, sizeof(sceneMagic)) != 0)
+    {
+        throw std::runtime_error(filename + " is not a scene cache");
+    }
+    if (header.version != scene_cache_version || header.byte_order != byteOrderMark)
+    {
+        throw std::runtime_error(filename + " is a scene cache of another version or byte order");
+    }
+    if ((size - sizeof(header)) / sizeof(scene_entry) < header.mesh_count)
+    {
+        throw std::runtime_error(filename + " is truncated");
+    }
+
+    // The entries are aligned in the page aligned mapping, so they and the arrays are read in place
+    const scene_entry* entries = (const scene_entry*)(data + sizeof(header));
+    for (std::uint32_t i = 0; i < header.mesh_count; ++i)
+    {
+        const scene_entry& e = entries[i];
+        std::uint64_t ranges[3][2] = {{e.positions, e.position_count}, {e.indices, e.index_count}, {e.colors, e.color_count}};
+        for (auto& range : ranges)
+        {
+            if (range[0] % arrayAlignment != 0 || range[0] > size || (size - range[0]) / 12 < range[1])
+            {
+                throw std::runtime_error(filename + " has a mesh outside the file");
+            }
+        }
+    }
+
+    std::vector<mesh_buffers> meshes;
+    mesh_buffers ids;
+    int loaded = 0; // buffers of ids loaded so far
+    try
+    {
+        for (std::uint32_t i = 0; i < header.mesh_count; ++i)
+        {
+            const scene_entry& e = entries[i];
+            ids.positions = r.load_positions((const Eigen::Vector3f*)(data + e.positions), (size_t)e.position_count, file);
+            loaded = 1;
+            ids.indices = r.load_indices((const Eigen::Vector3i*)(data + e.indices), (size_t)e.index_count, file);
+            loaded = 2;
+            ids.colors = r.load_colors((const Eigen::Vector3f*)(data + e.colors), (size_t)e.color_count, file);
+            loaded = 3;
+            meshes.push_back(ids);
+            loaded = 0;
+        }
+    }
+    catch (...)
+    {
+        // The caller gets no ids to unload, so nothing of the scene may stay loaded
+        if (loaded > 0)
+        {
+            r.unload(ids.positions);
+        }
+        if (loaded > 1)
+        {
+            r.unload(ids.indices);
+        }
+        if (loaded > 2)
+        {
+            r.unload(ids.colors);
+        }
+        for (auto& m : meshes)
+        {
+            r.unload(m.positions);
+            r.unload(m.indices);
+            r.unload(m.colors);
+        }
+        throw;
+    }
+    return meshes;
+}
@@ -0,0 +1,53 @@
+//
+// Binary scene cache: the vertex, index and colour buffers of a scene, mapped back in without parsing.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "mesh_loader.hpp"
+
+namespace rst
+{
+    /*
+     * A cache file holds the buffers of any number of meshes as they lie in memory, so loading it maps
+     * the file and hands the rasterizer pointers into the mapping instead of reading or converting any
+     * element. Layout, in the byte order of the machine that wrote it, with 64 byte aligned arrays:
+     *
+     *   scene_header
+     *   scene_entry per mesh
+     *   per mesh: positions (3 floats each), indices (3 int32 each), colours (3 floats each)
+     *
+     * Files from a different version or written by a machine of the other byte order are rejected; so
+     * are entries pointing outside the file. Indices are not checked when loading, draw rejects those
+     * out of range.
+     * */
+    constexpr std::uint32_t scene_cache_version = 1;
+
+    struct scene_header
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;
+        std::uint32_t mesh_count;
+        std::uint32_t reserved[11];
+    };
+
+    // Offsets from the start of the file and element counts of one mesh's arrays
+    struct scene_entry
+    {
+        std::uint64_t positions, position_count;
+        std::uint64_t indices, index_count;
+        std::uint64_t colors, color_count;
+        std::uint64_t reserved[2];
+    };
+
+    // Writes the buffers of meshes, through a temporary file that replaces filename once complete
+    void save_scene(const std::string& filename, const rasterizer& r, const std::vector<mesh_buffers>& meshes);
+
+    // Loads the meshes of a cache file in the order they were saved. The buffers borrow the mapping,
+    // which stays alive until all of them are unloaded.
+    std::vector<mesh_buffers> load_scene(rasterizer& r, const std::string& filename);
+}
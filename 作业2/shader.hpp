@@ -0,0 +1,135 @@
+//
+// Programmable vertex and fragment stages.
+//
+
+#pragma once
+
+#include <Eigen/Eigen>
+#include <cstdint>
+#include "raster_rows.hpp"
+#include "varyings.hpp"
+
+namespace rst
+{
+    /*
+     * rasterizer::draw accepts any type with these members as a shader and is instantiated for it, so the
+     * fragment stage is inlined into the pixel loop:
+     *
+     *   int varyings() const;              float components a vertex hands to the fragment stage (<= max_varyings)
+     *   std::uint32_t reads() const;       bit j set if fragment() reads component j; only those are interpolated
+     *   Eigen::Vector4f vertex(int index, const Eigen::Vector3f& position, float* out) const;
+     *                                      clip space position of vertex index of the position buffer,
+     *                                      writing its varyings to out
+     *   Eigen::Vector3f fragment(int x, int y, const float* in) const;
+     *                                      colour (0..255 per channel) of pixel (x, y) from the perspective
+     *                                      correct varyings
+     *
+     * fragment may return an Eigen::Vector4f instead, with the alpha (0..1) of the pixel last. Translucent
+     * draws (see rasterizer::set_blend) multiply it with the draw's alpha; opaque ones ignore it.
+     *
+     * A shader that needs screen space derivatives, e.g. to pick the mip level of a texture, declares
+     * fragment with two more arguments instead, which receive them per 2x2 pixel quad for the components
+     * it reads (see varying_row::derivatives):
+     *
+     *   Eigen::Vector3f fragment(int x, int y, const float* in, const float* ddx, const float* ddy) const;
+     *
+     * Fragments are shaded on every rasterizer thread at once, so fragment() must not modify shared state.
+     * virtual_shader below satisfies this with virtual calls, for prototyping.
+     * */
+    class virtual_shader
+    {
+    public:
+        virtual ~virtual_shader() = default;
+
+        virtual int varyings() const = 0;
+        virtual std::uint32_t reads() const { return ~0u; }
+        virtual Eigen::Vector4f vertex(int index, const Eigen::Vector3f& position, float* out) const = 0;
+        virtual Eigen::Vector3f fragment(int x, int y, const float* in) const = 0;
+    };
+
+    // Colour and alpha of a fragment shader's result, opaque unless it returns an alpha
+    inline Eigen::Vector3f to_rgb(const Eigen::Vector3f& color) { return color; }
+    inline Eigen::Vector3f to_rgb(const Eigen::Vector4f& color) { return color.head<3>(); }
+    inline Eigen::Vector4f to_rgba(const Eigen::Vector3f& color) { return {color.x(), color.y(), color.z(), 1.0f}; }
+    inline Eigen::Vector4f to_rgba(const Eigen::Vector4f& color) { return color; }
+
+    // Pixel x of a row through the fragment shader, with derivatives if it takes them
+    template <class Shader>
+    auto run_fragment(const Shader& shader, const varying_row& row, int x, int y, float* in, int)
+        -> decltype(shader.fragment(x, y, in, in, in))
+    {
+        float ddx[max_varyings], ddy[max_varyings];
+        row.at(x, in);
+        row.derivatives(x, ddx, ddy);
+        return shader.fragment(x, y, in, ddx, ddy);
+    }
+
+    template <class Shader>
+    auto run_fragment(const Shader& shader, const varying_row& row, int x, int y, float* in, long)
+        -> decltype(shader.fragment(x, y, in))
+    {
+        row.at(x, in);
+        return shader.fragment(x, y, in);
+    }
+
+    // Runs the fragment shader of one row for a pixel once one of its samples passed the depth test: the
+    // call operator encodes its colour for opaque draws, rgba gives colour and alpha for translucent ones
+    template <class Shader>
+    struct fragment_shade
+    {
+        static constexpr bool flat = false;
+        const Shader& shader;
+        varying_row row;
+        pixel_format format;
+        int y;
+        mutable unsigned char pixel[16];
+
+        const unsigned char* operator()(int x) const
+        {
+            float in[max_varyings];
+            encode_pixel(format, to_rgb(run_fragment(shader, row, x, y, in, 0)), pixel);
+            return pixel;
+        }
+
+        Eigen::Vector4f rgba(int x) const
+        {
+            float in[max_varyings];
+            return to_rgba(run_fragment(shader, row, x, y, in, 0));
+        }
+    };
+
+    // Draws the pixels x1..x2, y1..y2 of a triangle with a shader, passed type-erased by the rasterizer
+    using shade_fn = void (*)(const void* shader, const raster_target& target, const triangle_setup& s,
+                              const sample_setup& ss, const varying_setup& v, int x1, int y1, int x2, int y2,
+                              bool depth_test);
+
+    template <class Shader>
+    void shade_triangle(const void* shader, const raster_target& target, const triangle_setup& s,
+                        const sample_setup& ss, const varying_setup& v, int x1, int y1, int x2, int y2,
+                        bool depth_test)
+    {
+        const Shader& sh = *static_cast<const Shader*>(shader);
+        std::uint32_t reads = sh.reads();
+        auto row_shade = [&](int y, float sy) {
+            return fragment_shade<Shader>{sh, varying_row(v, reads, sy), target.format, y, {}};
+        };
+        rasterize_rows<fragment_shade<Shader>>(target, s, ss, x1, y1, x2, y2, row_shade, depth_test);
+    }
+
+    // Shades the pixels x1..x2 of row y, which the deferred pass found covered by one triangle, into out
+    using span_shade_fn = void (*)(const void* shader, const varying_setup& v, int x1, int x2, int y,
+                                   pixel_format format, int pixel_bytes, unsigned char* out);
+
+    template <class Shader>
+    void shade_span(const void* shader, const varying_setup& v, int x1, int x2, int y, pixel_format format,
+                    int pixel_bytes, unsigned char* out)
+    {
+        const Shader& sh = *static_cast<const Shader*>(shader);
+        varying_row row(v, sh.reads(), (float)y + 0.5f);
+        float in[max_varyings];
+        for (int x = x1; x <= x2; ++x, out += pixel_bytes)
+        {
+            encode_pixel(format, to_rgb(run_fragment(sh, row, x, y, in, 0)), out);
+        }
+    }
+}
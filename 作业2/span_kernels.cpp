@@ -0,0 +1,389 @@
+//
+// Pixel span kernels: coverage, depth test and colour write for one row of a triangle.
+//
+
+#include "span_kernels.hpp"
+#include "pipeline_stats.hpp"
+#include <algorithm>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RST_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and clang only emit AVX instructions inside functions that ask for them; MSVC always does
+#if defined(RST_X86) && (defined(__GNUC__) || defined(__clang__))
+#define RST_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define RST_TARGET_AVX2
+#endif
+
+static inline bool insideEdge(float e, bool top_left)
+{
+    return e > 0 || (e == 0 && top_left);
+}
+
+// Edge function i at pixel x of the row is a_i * (x + 0.5) + e[i], the same expression whichever triangle
+// and row start, so the two triangles of a shared edge get exactly opposite values and the fill rule gives
+// a pixel on it to exactly one of them. Depth is stepped from the row start.
+struct span_start
+{
+    float e[3];
+    float z;
+};
+
+static inline span_start spanStart(const rst::triangle_setup& s, int x1, float sy)
+{
+    float sx = (float)x1 + 0.5f;
+    span_start r;
+    for (int i = 0; i < 3; ++i)
+    {
+        r.e[i] = s.edge_b[i] * sy + s.edge_c[i];
+    }
+    r.z = s.z_a * sx + s.z_b * sy + s.z_c;
+    return r;
+}
+
+template <int Bytes>
+static inline void storePixel(unsigned char* color, int x, const void* pixel)
+{
+    std::memcpy(color + x * Bytes, pixel, Bytes);
+}
+
+template <int Bytes>
+static inline void spanScalar(const rst::triangle_setup& s, const span_start& r, int x1, int from, int x2,
+                              float* depth, unsigned char* color, const void* pixel, bool depth_test)
+{
+    for (int x = from; x <= x2; ++x)
+    {
+        float dx = (float)(x - x1), px = (float)x + 0.5f;
+        if (insideEdge(s.edge_a[0] * px + r.e[0], s.top_left[0])
+            && insideEdge(s.edge_a[1] * px + r.e[1], s.top_left[1])
+            && insideEdge(s.edge_a[2] * px + r.e[2], s.top_left[2]))
+        {
+            RST_STAT(rst::thread_counters->pixels_covered++);
+            float z = r.z + s.z_a * dx;
+            if (!depth_test || depth[x] > z)
+            {
+                RST_STAT(rst::thread_counters->depth_passed++);
+                depth[x] = z;
+                storePixel<Bytes>(color, x, pixel);
+            }
+        }
+    }
+}
+
+template <int Bytes>
+static void spanKernelScalar(const rst::triangle_setup& s, int x1, int x2, float sy,
+                             float* depth, unsigned char* color, const void* pixel, bool depth_test)
+{
+    spanScalar<Bytes>(s, spanStart(s, x1, sy), x1, x1, x2, depth, color, pixel, depth_test);
+}
+
+#ifdef RST_X86
+
+template <int Bytes>
+static void spanKernelSSE(const rst::triangle_setup& s, int x1, int x2, float sy,
+                          float* depth, unsigned char* color, const void* pixel, bool depth_test)
+{
+    span_start r = spanStart(s, x1, sy);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 lane = _mm_setr_ps(0, 1, 2, 3);
+    __m128 e0 = _mm_set1_ps(r.e[0]), e1 = _mm_set1_ps(r.e[1]), e2 = _mm_set1_ps(r.e[2]), z0 = _mm_set1_ps(r.z);
+    __m128 a0 = _mm_set1_ps(s.edge_a[0]), a1 = _mm_set1_ps(s.edge_a[1]), a2 = _mm_set1_ps(s.edge_a[2]), za = _mm_set1_ps(s.z_a);
+    __m128 tl0 = _mm_castsi128_ps(_mm_set1_epi32(s.top_left[0] ? -1 : 0));
+    __m128 tl1 = _mm_castsi128_ps(_mm_set1_epi32(s.top_left[1] ? -1 : 0));
+    __m128 tl2 = _mm_castsi128_ps(_mm_set1_epi32(s.top_left[2] ? -1 : 0));
+    std::int32_t packed = 0;
+    if (Bytes == 4)
+    {
+        std::memcpy(&packed, pixel, 4);
+    }
+    const __m128i packed4 = _mm_set1_epi32(packed);
+
+    int x = x1;
+    for (; x + 3 <= x2; x += 4)
+    {
+        __m128 dx = _mm_add_ps(_mm_set1_ps((float)(x - x1)), lane);
+        __m128 px = _mm_add_ps(_mm_set1_ps((float)x + 0.5f), lane);
+        __m128 v0 = _mm_add_ps(_mm_mul_ps(a0, px), e0);
+        __m128 v1 = _mm_add_ps(_mm_mul_ps(a1, px), e1);
+        __m128 v2 = _mm_add_ps(_mm_mul_ps(a2, px), e2);
+        __m128 in = _mm_and_ps(_mm_or_ps(_mm_cmpgt_ps(v0, zero), _mm_and_ps(_mm_cmpeq_ps(v0, zero), tl0)),
+                               _mm_or_ps(_mm_cmpgt_ps(v1, zero), _mm_and_ps(_mm_cmpeq_ps(v1, zero), tl1)));
+        in = _mm_and_ps(in, _mm_or_ps(_mm_cmpgt_ps(v2, zero), _mm_and_ps(_mm_cmpeq_ps(v2, zero), tl2)));
+        if (_mm_movemask_ps(in) == 0)
+        {
+            continue;
+        }
+        RST_STAT(rst::thread_counters->pixels_covered += rst::count_bits(_mm_movemask_ps(in)));
+
+        __m128 z = _mm_add_ps(z0, _mm_mul_ps(za, dx));
+        __m128 old = _mm_loadu_ps(depth + x);
+        __m128 pass = depth_test ? _mm_and_ps(in, _mm_cmpgt_ps(old, z)) : in;
+        int mask = _mm_movemask_ps(pass);
+        RST_STAT(rst::thread_counters->depth_passed += rst::count_bits(mask));
+        if (mask == 0)
+        {
+            continue;
+        }
+        _mm_storeu_ps(depth + x, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, old)));
+        if (Bytes == 4)
+        {
+            // Packed 32-bit pixels: blend all four lanes with one load and one store
+            __m128i* dst = (__m128i*)(color + x * 4);
+            __m128i keep = _mm_castps_si128(pass);
+            __m128i cur = _mm_loadu_si128(dst);
+            _mm_storeu_si128(dst, _mm_or_si128(_mm_and_si128(keep, packed4), _mm_andnot_si128(keep, cur)));
+        }
+        else
+        {
+            for (int k = 0; k < 4; ++k)
+            {
+                if (mask & (1 << k))
+                {
+                    storePixel<Bytes>(color, x + k, pixel);
+                }
+            }
+        }
+    }
+    spanScalar<Bytes>(s, r, x1, x, x2, depth, color, pixel, depth_test);
+}
+
+template <int Bytes>
+RST_TARGET_AVX2
+static void spanKernelAVX2(const rst::triangle_setup& s, int x1, int x2, float sy,
+                           float* depth, unsigned char* color, const void* pixel, bool depth_test)
+{
+    span_start r = spanStart(s, x1, sy);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 e0 = _mm256_set1_ps(r.e[0]), e1 = _mm256_set1_ps(r.e[1]), e2 = _mm256_set1_ps(r.e[2]), z0 = _mm256_set1_ps(r.z);
+    __m256 a0 = _mm256_set1_ps(s.edge_a[0]), a1 = _mm256_set1_ps(s.edge_a[1]), a2 = _mm256_set1_ps(s.edge_a[2]), za = _mm256_set1_ps(s.z_a);
+    __m256 tl0 = _mm256_castsi256_ps(_mm256_set1_epi32(s.top_left[0] ? -1 : 0));
+    __m256 tl1 = _mm256_castsi256_ps(_mm256_set1_epi32(s.top_left[1] ? -1 : 0));
+    __m256 tl2 = _mm256_castsi256_ps(_mm256_set1_epi32(s.top_left[2] ? -1 : 0));
+    std::int32_t packed = 0;
+    if (Bytes == 4)
+    {
+        std::memcpy(&packed, pixel, 4);
+    }
+    const __m256i packed8 = _mm256_set1_epi32(packed);
+
+    int x = x1;
+    for (; x + 7 <= x2; x += 8)
+    {
+        __m256 dx = _mm256_add_ps(_mm256_set1_ps((float)(x - x1)), lane);
+        __m256 px = _mm256_add_ps(_mm256_set1_ps((float)x + 0.5f), lane);
+        __m256 v0 = _mm256_add_ps(_mm256_mul_ps(a0, px), e0);
+        __m256 v1 = _mm256_add_ps(_mm256_mul_ps(a1, px), e1);
+        __m256 v2 = _mm256_add_ps(_mm256_mul_ps(a2, px), e2);
+        __m256 in = _mm256_and_ps(
+            _mm256_or_ps(_mm256_cmp_ps(v0, zero, _CMP_GT_OQ), _mm256_and_ps(_mm256_cmp_ps(v0, zero, _CMP_EQ_OQ), tl0)),
+            _mm256_or_ps(_mm256_cmp_ps(v1, zero, _CMP_GT_OQ), _mm256_and_ps(_mm256_cmp_ps(v1, zero, _CMP_EQ_OQ), tl1)));
+        in = _mm256_and_ps(in,
+            _mm256_or_ps(_mm256_cmp_ps(v2, zero, _CMP_GT_OQ), _mm256_and_ps(_mm256_cmp_ps(v2, zero, _CMP_EQ_OQ), tl2)));
+        if (_mm256_movemask_ps(in) == 0)
+        {
+            continue;
+        }
+        RST_STAT(rst::thread_counters->pixels_covered += rst::count_bits(_mm256_movemask_ps(in)));
+
+        __m256 z = _mm256_add_ps(z0, _mm256_mul_ps(za, dx));
+        __m256 old = _mm256_loadu_ps(depth + x);
+        __m256 pass = depth_test ? _mm256_and_ps(in, _mm256_cmp_ps(old, z, _CMP_GT_OQ)) : in;
+        int mask = _mm256_movemask_ps(pass);
+        RST_STAT(rst::thread_counters->depth_passed += rst::count_bits(mask));
+        if (mask == 0)
+        {
+            continue;
+        }
+        _mm256_storeu_ps(depth + x, _mm256_blendv_ps(old, z, pass));
+        if (Bytes == 4)
+        {
+            _mm256_maskstore_epi32((int*)(color + x * 4), _mm256_castps_si256(pass), packed8);
+        }
+        else
+        {
+            for (int k = 0; k < 8; ++k)
+            {
+                if (mask & (1 << k))
+                {
+                    storePixel<Bytes>(color, x + k, pixel);
+                }
+            }
+        }
+    }
+    spanScalar<Bytes>(s, r, x1, x, x2, depth, color, pixel, depth_test);
+}
+
+static bool cpuHasAVX2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+    {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+    {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+void rst::depth_range(const float* depth, int count, float& lo, float& hi)
+{
+    int i = 0;
+#ifdef RST_X86
+    __m128 vlo = _mm_set1_ps(lo), vhi = _mm_set1_ps(hi);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 v = _mm_loadu_ps(depth + i);
+        vlo = _mm_min_ps(vlo, v);
+        vhi = _mm_max_ps(vhi, v);
+    }
+    alignas(16) float l[4], h[4];
+    _mm_store_ps(l, vlo);
+    _mm_store_ps(h, vhi);
+    for (int k = 0; k < 4; ++k)
+    {
+        lo = std::min(lo, l[k]);
+        hi = std::max(hi, h[k]);
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        lo = std::min(lo, depth[i]);
+        hi = std::max(hi, depth[i]);
+    }
+}
+
+// One value of 2, 3, 4, 8, 12 or 16 bytes, with a copy of constant size the compiler inlines
+static inline void copyValue(unsigned char* dst, const void* value, int bytes)
+{
+    switch (bytes)
+    {
+    case 2: std::memcpy(dst, value, 2); break;
+    case 3: std::memcpy(dst, value, 3); break;
+    case 4: std::memcpy(dst, value, 4); break;
+    case 8: std::memcpy(dst, value, 8); break;
+    case 12: std::memcpy(dst, value, 12); break;
+    default: std::memcpy(dst, value, 16); break;
+    }
+}
+
+void rst::fill_pixels(unsigned char* dst, size_t count, const void* value, int bytes, bool stream)
+{
+    size_t i = 0;
+#ifdef RST_X86
+    // Values one by one up to the first 16 byte boundary, then 48 bytes (a whole number of values of
+    // any of the sizes) per step. Buffers that never reach the boundary, like 4 byte values at an odd
+    // address, are filled one value at a time below.
+    while (i < count && i < 16 && (std::uintptr_t)(dst + i * bytes) % 16 != 0)
+    {
+        copyValue(dst + i * bytes, value, bytes);
+        ++i;
+    }
+    if ((std::uintptr_t)(dst + i * bytes) % 16 == 0)
+    {
+        alignas(16) unsigned char pattern[48];
+        for (int k = 0; k < 48; k += bytes)
+        {
+            copyValue(pattern + k, value, bytes);
+        }
+        const __m128i b0 = _mm_load_si128((const __m128i*)pattern);
+        const __m128i b1 = _mm_load_si128((const __m128i*)(pattern + 16));
+        const __m128i b2 = _mm_load_si128((const __m128i*)(pattern + 32));
+        unsigned char* p = dst + i * bytes;
+        unsigned char* end = p + (count - i) * bytes;
+        if (stream)
+        {
+            for (; p + 48 <= end; p += 48)
+            {
+                _mm_stream_si128((__m128i*)p, b0);
+                _mm_stream_si128((__m128i*)(p + 16), b1);
+                _mm_stream_si128((__m128i*)(p + 32), b2);
+            }
+            // Streaming stores are weakly ordered; make them visible before anyone else reads the memory
+            _mm_sfence();
+        }
+        else
+        {
+            for (; p + 48 <= end; p += 48)
+            {
+                _mm_store_si128((__m128i*)p, b0);
+                _mm_store_si128((__m128i*)(p + 16), b1);
+                _mm_store_si128((__m128i*)(p + 32), b2);
+            }
+        }
+        i = (size_t)(p - dst) / bytes;
+    }
+#else
+    (void)stream;
+#endif
+    for (; i < count; ++i)
+    {
+        copyValue(dst + i * bytes, value, bytes);
+    }
+}
+
+rst::simd_level rst::detect_simd_level()
+{
+#ifdef RST_X86
+    if (cpuHasAVX2())
+    {
+        return simd_level::AVX2;
+    }
+    return simd_level::SSE;
+#else
+    return simd_level::Scalar;
+#endif
+}
+
+template <int Bytes>
+static rst::span_kernel spanKernelFor(rst::simd_level level)
+{
+#ifdef RST_X86
+    switch (level)
+    {
+    case rst::simd_level::AVX2:
+        return spanKernelAVX2<Bytes>;
+    case rst::simd_level::SSE:
+        return spanKernelSSE<Bytes>;
+    default:
+        break;
+    }
+#endif
+    return spanKernelScalar<Bytes>;
+}
+
+rst::span_kernel rst::get_span_kernel(simd_level level, int bytes_per_pixel)
+{
+    switch (bytes_per_pixel)
+    {
+    case 4:
+        return spanKernelFor<4>(level);
+    case 8:
+        return spanKernelFor<8>(level);
+    case 12:
+        return spanKernelFor<12>(level);
+    case 16:
+        return spanKernelFor<16>(level);
+    }
+    return nullptr;
+}
@@ -0,0 +1,58 @@
+//
+// Pixel span kernels: coverage, depth test and colour write for one row of a triangle.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace rst
+{
+    /*
+     * Per triangle data computed once in draw() and shared by every tile the triangle is binned into:
+     * edge i is a_i * x + b_i * y + c_i, positive inside the triangle, and the interpolated depth is
+     * z_a * x + z_b * y + z_c. The bounding box is in pixels and not yet clamped to the screen.
+     * */
+    struct triangle_setup
+    {
+        float edge_a[3], edge_b[3], edge_c[3];
+        bool top_left[3];
+        float inv_area;
+        float z_a, z_b, z_c;
+        float z_min, z_max;
+        int x_min, y_min, x_max, y_max;
+    };
+
+    enum class simd_level
+    {
+        Scalar,
+        SSE,
+        AVX2
+    };
+
+    /*
+     * Shades the pixels x1..x2 of the row whose sample centres lie at height sy with one pre-encoded
+     * pixel value. depth and color point at the start of the row, so pixel x lives at depth[x] and at
+     * color + x * bytes_per_pixel. Without depth_test every covered pixel is written, for triangles
+     * known to lie in front of everything in the span.
+     * Every kernel evaluates the edges and depth as value_at_x1 + step * (x - x1), so all of them
+     * produce bit-identical images and the choice of kernel never changes the output.
+     * */
+    using span_kernel = void (*)(const triangle_setup& s, int x1, int x2, float sy,
+                                 float* depth, unsigned char* color, const void* pixel, bool depth_test);
+
+    // Widens [lo, hi] to include the count depth values starting at depth
+    void depth_range(const float* depth, int count, float& lo, float& hi);
+
+    // Writes count copies of the bytes long value (2, 3, 4, 8, 12 or 16 bytes) to dst, with 16 byte
+    // stores. With stream the stores bypass the cache (non-temporal), for memory that is not read again soon.
+    void fill_pixels(unsigned char* dst, size_t count, const void* value, int bytes, bool stream);
+
+    // Best level supported by the CPU we are running on
+    simd_level detect_simd_level();
+
+    // Kernel for the requested level and pixel size (4, 8, 12 or 16 bytes), falling back to a lower
+    // level if it was not compiled in
+    span_kernel get_span_kernel(simd_level level, int bytes_per_pixel);
+}
@@ -0,0 +1,191 @@
+//
+// Mipmapped textures, stored tile by tile for cache friendly filtering.
+//
+
+#include "texture.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// Position of (x, y), both below 4, in a Morton ordered 4x4 tile: the bits of x and y interleaved
+static int mortonIndex(int x, int y)
+{
+    return (x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2);
+}
+
+static Eigen::Vector4f unpack(std::uint32_t t)
+{
+    return Eigen::Vector4f(float(t & 0xff), float((t >> 8) & 0xff), float((t >> 16) & 0xff), float(t >> 24));
+}
+
+rst::texture::texture(int width, int height, int channels, const unsigned char* data, texture_layout layout)
+    : layout(layout)
+{
+    if (width <= 0 || height <= 0)
+    {
+        throw std::runtime_error("A texture needs at least one texel!");
+    }
+    if (channels != 3 && channels != 4)
+    {
+        throw std::runtime_error("Textures are made from RGB or RGBA images, not " + std::to_string(channels) + " channels");
+    }
+
+    add_level(width, height);
+    for (int y = 0; y < height; ++y)
+    {
+        const unsigned char* row = data + (size_t)(height - 1 - y) * width * channels;
+        for (int x = 0; x < width; ++x, row += channels)
+        {
+            std::uint32_t a = channels == 4 ? row[3] : 255;
+            at(mips[0], x, y) = row[0] | (row[1] << 8) | (row[2] << 16) | (a << 24);
+        }
+    }
+
+    // Every level is the box filtered one above it; the last texel of an odd row or column is used twice
+    while (width > 1 || height > 1)
+    {
+        int src = (int)mips.size() - 1;
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+        add_level(width, height);
+        const mip_level& s = mips[src];
+        const mip_level& d = mips.back();
+        for (int y = 0; y < d.height; ++y)
+        {
+            int y0 = std::min(2 * y, s.height - 1), y1 = std::min(2 * y + 1, s.height - 1);
+            for (int x = 0; x < d.width; ++x)
+            {
+                int x0 = std::min(2 * x, s.width - 1), x1 = std::min(2 * x + 1, s.width - 1);
+                std::uint32_t quad[4] = {at(s, x0, y0), at(s, x1, y0), at(s, x0, y1), at(s, x1, y1)};
+                std::uint32_t t = 0;
+                for (int c = 0; c < 32; c += 8)
+                {
+                    std::uint32_t sum = 2;
+                    for (std::uint32_t q : quad)
+                    {
+                        sum += (q >> c) & 0xff;
+                    }
+                    t |= (sum / 4) << c;
+                }
+                at(d, x, y) = t;
+            }
+        }
+    }
+}
+
+// Levels are padded to whole tiles
+void rst::texture::add_level(int w, int h)
+{
+    mip_level m{w, h, (w + 3) / 4, texels.size()};
+    mips.push_back(m);
+    texels.resize(texels.size() + (size_t)m.tiles_x * ((h + 3) / 4) * 16);
+}
+
+std::size_t rst::texture::index(const mip_level& m, int x, int y) const
+{
+    if (layout == texture_layout::Rows)
+    {
+        return m.offset + (size_t)y * m.width + x;
+    }
+    return m.offset + ((size_t)(y >> 2) * m.tiles_x + (x >> 2)) * 16 + mortonIndex(x & 3, y & 3);
+}
+
+std::uint32_t& rst::texture::at(const mip_level& m, int x, int y)
+{
+    return texels[index(m, x, y)];
+}
+
+std::uint32_t rst::texture::at(const mip_level& m, int x, int y) const
+{
+    return texels[index(m, x, y)];
+}
+
+// Brings a coordinate into 0..1 before it is scaled to texels, where converting it to int cannot
+// overflow: repeated by its fraction, or clamped. NaN and infinities give 0
+float rst::texture::wrap_unit(float t) const
+{
+    if (wrap == texture_wrap::Repeat)
+    {
+        t -= std::floor(t);
+    }
+    else
+    {
+        t = std::min(t, 1.0f);
+    }
+    // Also false for NaN, and for the 1 that the fraction of a tiny negative t rounds to
+    return t >= 0 && t <= 1 ? t : 0.0f;
+}
+
+int rst::texture::wrap_coord(int i, int size) const
+{
+    if (wrap == texture_wrap::Repeat)
+    {
+        i %= size;
+        return i < 0 ? i + size : i;
+    }
+    return std::min(std::max(i, 0), size - 1);
+}
+
+Eigen::Vector4f rst::texture::texel(int level, int x, int y) const
+{
+    return unpack(at(mips[level], x, y));
+}
+
+float rst::texture::lod(float dudx, float dvdx, float dudy, float dvdy) const
+{
+    float w = (float)mips[0].width, h = (float)mips[0].height;
+    float x = dudx * w, y = dvdx * h;
+    float along_x = x * x + y * y;
+    x = dudy * w;
+    y = dvdy * h;
+    float along_y = x * x + y * y;
+    // log2 of the root of the larger square
+    return 0.5f * std::log2(std::max(along_x, along_y));
+}
+
+Eigen::Vector4f rst::texture::nearest(const mip_level& m, float u, float v) const
+{
+    int x = wrap_coord((int)std::floor(wrap_unit(u) * m.width), m.width);
+    int y = wrap_coord((int)std::floor(wrap_unit(v) * m.height), m.height);
+    return unpack(at(m, x, y));
+}
+
+// Weighs the four texels whose centres surround (u, v)
+Eigen::Vector4f rst::texture::bilinear(const mip_level& m, float u, float v) const
+{
+    float x = wrap_unit(u) * m.width - 0.5f, y = wrap_unit(v) * m.height - 0.5f;
+    float fx = std::floor(x), fy = std::floor(y);
+    float tx = x - fx, ty = y - fy;
+    int x0 = wrap_coord((int)fx, m.width), x1 = wrap_coord((int)fx + 1, m.width);
+    int y0 = wrap_coord((int)fy, m.height), y1 = wrap_coord((int)fy + 1, m.height);
+
+    Eigen::Vector4f bottom = unpack(at(m, x0, y0)) * (1 - tx) + unpack(at(m, x1, y0)) * tx;
+    Eigen::Vector4f top = unpack(at(m, x0, y1)) * (1 - tx) + unpack(at(m, x1, y1)) * tx;
+    return bottom * (1 - ty) + top * ty;
+}
+
+Eigen::Vector4f rst::texture::sample(float u, float v, float lod) const
+{
+    // Magnified (lod <= 0), or NaN from a zero footprint, samples the full image
+    float last = (float)(mips.size() - 1);
+    lod = lod > 0 ? std::min(lod, last) : 0.0f;
+
+    switch (filter)
+    {
+    case texture_filter::Nearest:
+        return nearest(mips[(int)(lod + 0.5f)], u, v);
+    case texture_filter::Bilinear:
+        return bilinear(mips[(int)(lod + 0.5f)], u, v);
+    default:
+    {
+        int level = (int)lod;
+        float t = lod - (float)level;
+        Eigen::Vector4f fine = bilinear(mips[level], u, v);
+        if (t == 0)
+        {
+            return fine;
+        }
+        return fine * (1 - t) + bilinear(mips[level + 1], u, v) * t;
+    }
+    }
+}
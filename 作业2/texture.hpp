@@ -0,0 +1,106 @@
+//
+// Mipmapped textures, stored tile by tile for cache friendly filtering.
+//
+
+#pragma once
+
+#include <Eigen/Eigen>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace rst
+{
+    // Nearest texel or bilinear filtering within the closest mip level, or trilinear between the two
+    // levels around the level of detail
+    enum class texture_filter
+    {
+        Nearest,
+        Bilinear,
+        Trilinear
+    };
+
+    // What coordinates outside 0..1 address: the texture repeated, or its border texels
+    enum class texture_wrap
+    {
+        Repeat,
+        Clamp
+    };
+
+    // How texels are laid out in memory: in Morton ordered tiles (see texture), or image rows one after
+    // the other, to compare against
+    enum class texture_layout
+    {
+        Tiled,
+        Rows
+    };
+
+    /*
+     * An RGBA8 image and its mip chain, every level half the size of the one before down to 1x1. Each
+     * level is stored in 4x4 texel tiles of 64 bytes, a cache line, with the texels of a tile in Morton
+     * order and the tiles row by row. Whichever way a triangle rotates the texture on screen, the 2x2
+     * texels of a bilinear fetch and those of the neighbouring pixels then mostly share a line, where
+     * image rows would cost a line per texel row and a new one for every step across them.
+     *
+     * Texture coordinates (u, v) run from 0 to 1 across the image, v from its bottom row up. Samples are
+     * RGBA in 0..255, like the colours of the rest of the pipeline.
+     * */
+    class texture
+    {
+    public:
+        // channels bytes per texel (3: RGB, 4: RGBA), rows from the top of the image to its bottom
+        texture(int width, int height, int channels, const unsigned char* data,
+                texture_layout layout = texture_layout::Tiled);
+
+        // Reads an image file, throws if it cannot be read. Defined in texture_io.cpp, the one part of
+        // textures that needs OpenCV
+        static texture load(const std::string& filename);
+
+        int levels() const { return (int)mips.size(); }
+        int width(int level = 0) const { return mips[level].width; }
+        int height(int level = 0) const { return mips[level].height; }
+
+        void set_filter(texture_filter f) { filter = f; }
+        void set_wrap(texture_wrap w) { wrap = w; }
+
+        /*
+         * Level of detail of a pixel whose texture coordinates change by (dudx, dvdx) towards the next
+         * pixel in x and by (dudy, dvdy) in y: log2 of the longer side of its footprint in texels.
+         * */
+        float lod(float dudx, float dvdx, float dudy, float dvdy) const;
+
+        // Filtered sample at level of detail lod, clamped to the mip chain
+        Eigen::Vector4f sample(float u, float v, float lod = 0) const;
+        Eigen::Vector4f sample(float u, float v, float dudx, float dvdx, float dudy, float dvdy) const
+        {
+            return sample(u, v, lod(dudx, dvdx, dudy, dvdy));
+        }
+
+        // Texel (x, y) of a level, counting from its bottom left corner; both must be inside the level
+        Eigen::Vector4f texel(int level, int x, int y) const;
+
+    private:
+        struct mip_level
+        {
+            int width, height;
+            int tiles_x;
+            std::size_t offset;
+        };
+
+        void add_level(int w, int h);
+        std::size_t index(const mip_level& m, int x, int y) const;
+        std::uint32_t& at(const mip_level& m, int x, int y);
+        std::uint32_t at(const mip_level& m, int x, int y) const;
+        float wrap_unit(float t) const;
+        int wrap_coord(int i, int size) const;
+        Eigen::Vector4f nearest(const mip_level& m, float u, float v) const;
+        Eigen::Vector4f bilinear(const mip_level& m, float u, float v) const;
+
+        std::vector<mip_level> mips;
+        // R, G, B, A from the lowest byte up
+        std::vector<std::uint32_t> texels;
+        texture_layout layout;
+        texture_filter filter = texture_filter::Trilinear;
+        texture_wrap wrap = texture_wrap::Repeat;
+    };
+}
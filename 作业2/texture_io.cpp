@@ -0,0 +1,22 @@
+//
+// Reading textures from image files, apart from texture.cpp so that targets without OpenCV can use textures.
+//
+
+#include "texture.hpp"
+#include <stdexcept>
+#include <opencv2/opencv.hpp>
+
+rst::texture rst::texture::load(const std::string& filename)
+{
+    cv::Mat image = cv::imread(filename, cv::IMREAD_COLOR);
+    if (image.empty())
+    {
+        throw std::runtime_error("Cannot read texture " + filename);
+    }
+    cv::cvtColor(image, image, cv::COLOR_BGR2RGB);
+    if (!image.isContinuous())
+    {
+        image = image.clone();
+    }
+    return texture(image.cols, image.rows, 3, image.data);
+}
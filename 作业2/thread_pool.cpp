@@ -0,0 +1,168 @@
+//
+// Persistent worker pool used to rasterize screen tiles in parallel.
+//
+
+#include "thread_pool.hpp"
+#include <algorithm>
+
+rst::thread_pool::thread_pool(int threads)
+{
+    threads = std::max(1, threads);
+    for (int i = 0; i < threads; ++i)
+    {
+        queues.emplace_back(new work_queue);
+    }
+    for (int i = 1; i < threads; ++i)
+    {
+        workers.emplace_back(&thread_pool::worker_loop, this, i);
+    }
+}
+
+rst::thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> guard(state_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void rst::thread_pool::parallel_for(int count, const std::function<void(int, int)>& job)
+{
+    if (count <= 0)
+    {
+        return;
+    }
+    if (size() == 1 || count == 1)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            job(i, 0);
+        }
+        return;
+    }
+
+    // Hand every participant a contiguous range so neighbouring tiles tend to stay on one core
+    int participants = size();
+    for (int p = 0; p < participants; ++p)
+    {
+        int begin = (int)((long long)count * p / participants);
+        int end = (int)((long long)count * (p + 1) / participants);
+        std::lock_guard<std::mutex> guard(queues[p]->lock);
+        for (int i = begin; i < end; ++i)
+        {
+            queues[p]->jobs.push_back(i);
+        }
+    }
+
+    remaining = count;
+    {
+        std::lock_guard<std::mutex> guard(state_lock);
+        current = &job;
+        busy = participants - 1;
+        ++generation;
+    }
+    wake.notify_all();
+
+    run_jobs(0);
+
+    // The job object lives on our caller's stack, so wait until no worker can still touch it
+    std::unique_lock<std::mutex> guard(state_lock);
+    done.wait(guard, [this] { return busy == 0; });
+    current = nullptr;
+    if (failed)
+    {
+        std::exception_ptr e = error;
+        error = nullptr;
+        failed = false;
+        std::rethrow_exception(e);
+    }
+}
+
+void rst::thread_pool::worker_loop(int participant)
+{
+    int seen = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> guard(state_lock);
+            wake.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping)
+            {
+                return;
+            }
+            seen = generation;
+        }
+
+        run_jobs(participant);
+
+        std::lock_guard<std::mutex> guard(state_lock);
+        if (--busy == 0)
+        {
+            done.notify_one();
+        }
+    }
+}
+
+void rst::thread_pool::run_jobs(int participant)
+{
+    int job;
+    while (remaining.load(std::memory_order_acquire) > 0)
+    {
+        if (!pop_job(participant, job))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        if (!failed.load(std::memory_order_relaxed))
+        {
+            try
+            {
+                (*current)(job, participant);
+            }
+            catch (...)
+            {
+                // An exception must not leave a worker thread; parallel_for hands the first one to its caller
+                std::lock_guard<std::mutex> guard(state_lock);
+                if (!failed)
+                {
+                    error = std::current_exception();
+                    failed = true;
+                }
+            }
+        }
+        remaining.fetch_sub(1, std::memory_order_acq_rel);
+    }
+}
+
+bool rst::thread_pool::pop_job(int participant, int& job)
+{
+    {
+        auto& own = *queues[participant];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.jobs.empty())
+        {
+            job = own.jobs.back();
+            own.jobs.pop_back();
+            return true;
+        }
+    }
+
+    int participants = size();
+    for (int offset = 1; offset < participants; ++offset)
+    {
+        auto& victim = *queues[(participant + offset) % participants];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.jobs.empty())
+        {
+            job = victim.jobs.front();
+            victim.jobs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
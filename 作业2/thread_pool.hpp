@@ -0,0 +1,65 @@
+//
+// Persistent worker pool used to rasterize screen tiles in parallel.
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rst
+{
+    /*
+     * Every participant (the calling thread is participant 0, the pool threads follow) owns a
+     * deque of job indices. A participant pops work from the back of its own deque and, once
+     * that runs dry, steals from the front of the others, so uneven tiles balance themselves.
+     * */
+    class thread_pool
+    {
+    public:
+        explicit thread_pool(int threads);
+        ~thread_pool();
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        // Number of participants, including the thread calling parallel_for
+        int size() const { return (int)queues.size(); }
+
+        // Runs job(index, participant) for every index in [0, count) and returns when all are done.
+        // If a job throws, the jobs not yet started are skipped and the first exception is rethrown here.
+        void parallel_for(int count, const std::function<void(int, int)>& job);
+
+    private:
+        struct work_queue
+        {
+            std::mutex lock;
+            std::deque<int> jobs;
+        };
+
+        void worker_loop(int participant);
+        void run_jobs(int participant);
+        bool pop_job(int participant, int& job);
+
+        std::vector<std::unique_ptr<work_queue>> queues;
+        std::vector<std::thread> workers;
+
+        std::mutex state_lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+        const std::function<void(int, int)>* current = nullptr;
+        std::atomic<int> remaining{0};
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+        int generation = 0;
+        int busy = 0;
+        bool stopping = false;
+    };
+}
@@ -0,0 +1,71 @@
+//
+// Perspective-correct interpolation of per-vertex attributes across a screen space triangle.
+//
+
+#include "varyings.hpp"
+#include <cmath>
+
+// Plane through the three vertex values, using barycentric weight e_i / area for vertex i
+static rst::plane vertexPlane(const rst::triangle_setup& s, float q0, float q1, float q2)
+{
+    return {(s.edge_a[0] * q0 + s.edge_a[1] * q1 + s.edge_a[2] * q2) * s.inv_area,
+            (s.edge_b[0] * q0 + s.edge_b[1] * q1 + s.edge_b[2] * q2) * s.inv_area,
+            (s.edge_c[0] * q0 + s.edge_c[1] * q1 + s.edge_c[2] * q2) * s.inv_area};
+}
+
+void rst::setup_varyings(const triangle_setup& s, const float inv_w[3], const float* const values[3], int count,
+                         varying_setup& out)
+{
+    out.inv_w = vertexPlane(s, inv_w[0], inv_w[1], inv_w[2]);
+    out.count = count;
+    for (int j = 0; j < count; ++j)
+    {
+        out.value[j] = vertexPlane(s, values[0][j] * inv_w[0], values[1][j] * inv_w[1], values[2][j] * inv_w[2]);
+    }
+}
+
+rst::varying_row::varying_row(const varying_setup& v, std::uint32_t mask, float sy)
+    : setup(v), mask(mask), sy(sy)
+{
+    inv_w = v.inv_w.b * sy + v.inv_w.c;
+    for (int j = 0; j < v.count; ++j)
+    {
+        if (mask & (1u << j))
+        {
+            value[j] = v.value[j].b * sy + v.value[j].c;
+        }
+    }
+}
+
+void rst::varying_row::at(int x, float* out) const
+{
+    float sx = (float)x + 0.5f;
+    float w = 1.0f / (setup.inv_w.a * sx + inv_w);
+    for (int j = 0; j < setup.count; ++j)
+    {
+        if (mask & (1u << j))
+        {
+            out[j] = (setup.value[j].a * sx + value[j]) * w;
+        }
+    }
+}
+
+void rst::varying_row::derivatives(int x, float* ddx, float* ddy) const
+{
+    float x0 = (float)(x & ~1) + 0.5f;
+    float y0 = std::floor(sy * 0.5f) * 2.0f + 0.5f;
+    const plane& q = setup.inv_w;
+    float w00 = 1.0f / (q.a * x0 + q.b * y0 + q.c);
+    float w10 = 1.0f / (q.a * (x0 + 1) + q.b * y0 + q.c);
+    float w01 = 1.0f / (q.a * x0 + q.b * (y0 + 1) + q.c);
+    for (int j = 0; j < setup.count; ++j)
+    {
+        if (mask & (1u << j))
+        {
+            const plane& p = setup.value[j];
+            float v00 = (p.a * x0 + p.b * y0 + p.c) * w00;
+            ddx[j] = (p.a * (x0 + 1) + p.b * y0 + p.c) * w10 - v00;
+            ddy[j] = (p.a * x0 + p.b * (y0 + 1) + p.c) * w01 - v00;
+        }
+    }
+}
@@ -0,0 +1,67 @@
+//
+// Perspective-correct interpolation of per-vertex attributes across a screen space triangle.
+//
+
+#pragma once
+
+#include <cstdint>
+#include "span_kernels.hpp"
+
+namespace rst
+{
+    // Most float components a vertex can hand to the pixel stage
+    constexpr int max_varyings = 16;
+
+    // q(x, y) = a * x + b * y + c over the screen
+    struct plane
+    {
+        float a, b, c;
+    };
+
+    /*
+     * An attribute is not linear in screen space, but the attribute divided by the vertex's clip space w
+     * is, and so is 1 / w. Setup turns both into planes over the triangle; a pixel then gets the ratio
+     * of the two, which is the perspective-correct value.
+     * */
+    struct varying_setup
+    {
+        plane inv_w;
+        int count = 0;
+        plane value[max_varyings];
+    };
+
+    // Planes for count components per vertex; values[i] points at the components of vertex i, whose
+    // clip space w is 1 / inv_w[i]. The weights come from the edge functions in s.
+    void setup_varyings(const triangle_setup& s, const float inv_w[3], const float* const values[3], int count,
+                        varying_setup& out);
+
+    /*
+     * The varyings along one row of pixels, sampled at the pixel centres. The row's part of every plane
+     * is folded in once, leaving one multiply-add per component and pixel; it does not depend on where
+     * the row starts, so a pixel gets the same value whichever tile draws it. Only the components set
+     * in mask are computed, so a pixel stage pays for the attributes it actually reads.
+     * */
+    class varying_row
+    {
+    public:
+        varying_row(const varying_setup& v, std::uint32_t mask, float sy);
+
+        // Writes component j of pixel x to out[j] for every j in the mask
+        void at(int x, float* out) const;
+
+        /*
+         * Screen space derivatives of the components in the mask at pixel x, the same for the four pixels
+         * of its 2x2 quad: the differences between the quad's lower left pixel and its right and upper
+         * neighbours. The planes give the values of those pixels even where the triangle does not cover
+         * them, so no neighbour needs to be shaded.
+         * */
+        void derivatives(int x, float* ddx, float* ddy) const;
+
+    private:
+        const varying_setup& setup;
+        std::uint32_t mask;
+        float sy;
+        float inv_w;
+        float value[max_varyings];
+    };
+}
@@ -0,0 +1,227 @@
+//
+// Vertex processing: transforms every vertex of a draw call once into a structure-of-arrays cache, and
+// clips the triangles that need it in homogeneous space.
+//
+
+#include "vertex_stage.hpp"
+#include <algorithm>
+#include <cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RST_X86 1
+#include <immintrin.h>
+#endif
+
+void rst::vertex_cache::resize(std::size_t count)
+{
+    for (auto* c : {&x, &y, &z, &w, &sx, &sy, &sz})
+    {
+        c->resize(count);
+    }
+    code.resize(count);
+}
+
+// Clip space position of vertices [first, last), summing the matrix columns in the same order as the SSE path
+static void transformScalar(const Eigen::Vector3f* p, std::size_t first, std::size_t last, const Eigen::Matrix4f& m,
+                            rst::vertex_cache& out)
+{
+    float* dst[4] = {out.x.data(), out.y.data(), out.z.data(), out.w.data()};
+    for (std::size_t i = first; i < last; ++i)
+    {
+        for (int r = 0; r < 4; ++r)
+        {
+            dst[r][i] = m(r, 0) * p[i].x() + m(r, 1) * p[i].y() + m(r, 2) * p[i].z() + m(r, 3);
+        }
+    }
+}
+
+#ifdef RST_X86
+// Four vertices per step: three loads of the packed xyz triples are shuffled into x, y and z vectors
+static std::size_t transformSSE(const Eigen::Vector3f* p, std::size_t count, const Eigen::Matrix4f& m,
+                                rst::vertex_cache& out)
+{
+    const float* src = p[0].data();
+    float* dst[4] = {out.x.data(), out.y.data(), out.z.data(), out.w.data()};
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4, src += 12)
+    {
+        __m128 a = _mm_loadu_ps(src);     // x0 y0 z0 x1
+        __m128 b = _mm_loadu_ps(src + 4); // y1 z1 x2 y2
+        __m128 c = _mm_loadu_ps(src + 8); // z2 x3 y3 z3
+
+        __m128 px = _mm_shuffle_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 0, 0)),
+                                   _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 py = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)),
+                                   _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 pz = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)),
+                                   _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+
+        for (int r = 0; r < 4; ++r)
+        {
+            __m128 v = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m(r, 0)), px), _mm_mul_ps(_mm_set1_ps(m(r, 1)), py));
+            v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(m(r, 2)), pz));
+            v = _mm_add_ps(v, _mm_set1_ps(m(r, 3)));
+            _mm_storeu_ps(dst[r] + i, v);
+        }
+    }
+    return i;
+}
+#endif
+
+rst::viewport rst::make_viewport(int width, int height, const Eigen::Matrix4f& projection, bool reversed_z)
+{
+    viewport vp{width, height, 0.5f, reversed_z ? -0.5f : 0.5f, 0.0f};
+    const Eigen::Matrix4f& p = projection;
+    double a = p(2, 2), b = p(2, 3), c = p(3, 2);
+    if (p(2, 0) != 0 || p(2, 1) != 0 || p(3, 0) != 0 || p(3, 1) != 0 || p(3, 3) != 0 || b == 0 || c == 0)
+    {
+        return vp;
+    }
+
+    // At distance t in front of the eye (view space z = -t) the projection gives z = b - a * t and
+    // w = -c * t, so normalised depth is -1 at 1 / t = (a + c) / b and 1 at 1 / t = (a - c) / b. Some
+    // projections, like the one of main.cpp, put both planes behind the eye; their distances are taken
+    // all the same. Once flip_w made w positive in front, 1 / t = |c| / w.
+    double inv_near = std::max(std::abs(a + c), std::abs(a - c)) / std::abs(b);
+    double inv_far = std::min(std::abs(a + c), std::abs(a - c)) / std::abs(b);
+    if (!(inv_near > inv_far))
+    {
+        return vp;
+    }
+    // depth = (1 / near - 1 / t) / (1 / near - 1 / far), minus 1 for reversed-Z, which then is exactly 0
+    // at an infinite far plane
+    double range = inv_near - inv_far;
+    vp.f1 = 0.0f;
+    vp.f2 = float((reversed_z ? inv_far : inv_near) / range);
+    vp.f3 = float(-std::abs(c) / range);
+    return vp;
+}
+
+std::uint16_t rst::clip_volume::outcode(float x, float y, float z, float w) const
+{
+    float g = guard * w;
+    std::uint16_t behind = (w < w_min) ? 0x4040 : 0;
+    std::uint16_t beyond_depth = depth ? std::uint16_t(((z < -w) ? 0x1010 : 0) | ((z > w) ? 0x2020 : 0)) : 0;
+    return std::uint16_t(((x < -w) ? 0x0001 : 0) | ((x > w) ? 0x0002 : 0) | ((y < -w) ? 0x0004 : 0) | ((y > w) ? 0x0008 : 0) |
+                         ((x < -g) ? 0x0100 : 0) | ((x > g) ? 0x0200 : 0) | ((y < -g) ? 0x0400 : 0) | ((y > g) ? 0x0800 : 0) |
+                         behind | beyond_depth);
+}
+
+float rst::clip_volume::distance(int p, const float* v) const
+{
+    switch (p)
+    {
+        case 0: return v[0] + guard * v[3];
+        case 1: return guard * v[3] - v[0];
+        case 2: return v[1] + guard * v[3];
+        case 3: return guard * v[3] - v[1];
+        case 4: return v[2] + v[3];
+        case 5: return v[3] - v[2];
+        default: return v[3] - w_min;
+    }
+}
+
+void rst::transform_vertices(const Eigen::Vector3f* positions, std::size_t count, const Eigen::Matrix4f& mvp,
+                             const viewport& vp, const clip_volume& clip, simd_level level, vertex_cache& out)
+{
+    out.resize(count);
+    if (count == 0)
+    {
+        return;
+    }
+
+    std::size_t done = 0;
+#ifdef RST_X86
+    if (level != simd_level::Scalar)
+    {
+        done = transformSSE(positions, count, mvp, out);
+    }
+#endif
+    transformScalar(positions, done, count, mvp, out);
+    project_vertices(vp, clip, false, out);
+}
+
+void rst::project_vertices(const viewport& vp, const clip_volume& clip, bool flip, vertex_cache& out)
+{
+    std::size_t count = out.x.size();
+    if (flip)
+    {
+        for (auto* c : {&out.x, &out.y, &out.z, &out.w})
+        {
+            for (float& v : *c)
+            {
+                v = -v;
+            }
+        }
+    }
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        out.code[i] = clip.outcode(out.x[i], out.y[i], out.z[i], out.w[i]);
+        Eigen::Vector3f p = vp.to_screen(out.x[i], out.y[i], out.z[i], out.w[i]);
+        out.sx[i] = p.x();
+        out.sy[i] = p.y();
+        out.sz[i] = p.z();
+    }
+}
+
+int rst::clip_triangle(const clip_vertex in[3], std::uint16_t planes, const clip_volume& clip, clip_vertex out[10])
+{
+    clip_vertex buffer[10];
+    const clip_vertex* src = in;
+    clip_vertex* dst = out;
+    int count = 3;
+
+    for (int p = 0; p < 7; ++p)
+    {
+        if (!(planes & (0x0100 << p)))
+        {
+            continue;
+        }
+
+        int kept = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            const clip_vertex& a = src[i];
+            const clip_vertex& b = src[(i + 1) % count];
+            float da = clip.distance(p, a.pos);
+            float db = clip.distance(p, b.pos);
+            if (da >= 0)
+            {
+                dst[kept++] = a;
+            }
+            if ((da >= 0) != (db >= 0))
+            {
+                // Interpolate from the inside end towards the outside one
+                const clip_vertex& from = da >= 0 ? a : b;
+                const clip_vertex& to = da >= 0 ? b : a;
+                float d_from = da >= 0 ? da : db;
+                float d_to = da >= 0 ? db : da;
+                float t = d_from / (d_from - d_to);
+                clip_vertex& v = dst[kept++];
+                for (int k = 0; k < 4; ++k)
+                {
+                    v.pos[k] = from.pos[k] + t * (to.pos[k] - from.pos[k]);
+                }
+                for (int k = 0; k < 3; ++k)
+                {
+                    v.weight[k] = from.weight[k] + t * (to.weight[k] - from.weight[k]);
+                }
+            }
+        }
+
+        count = kept;
+        if (count == 0)
+        {
+            return 0;
+        }
+        src = dst;
+        dst = (dst == out) ? buffer : out;
+    }
+
+    if (src != out)
+    {
+        std::copy(src, src + count, out);
+    }
+    return count;
+}
@@ -0,0 +1,105 @@
+//
+// Vertex processing: transforms every vertex of a draw call once into a structure-of-arrays cache, and
+// clips the triangles that need it in homogeneous space.
+//
+
+#pragma once
+
+#include <Eigen/Eigen>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "span_kernels.hpp"
+
+namespace rst
+{
+    /*
+     * Post-transform vertices, one array per component and indexed like the position buffer, so primitive
+     * assembly reads each shared vertex instead of transforming it again for every triangle using it.
+     * x, y, z, w are in clip space; sx, sy, sz are the screen space position after the perspective
+     * division and the viewport transform, and only meaningful for vertices the triangle needs no
+     * clipping for. code holds the clip_volume outcode of each vertex.
+     * */
+    struct vertex_cache
+    {
+        std::vector<float> x, y, z, w;
+        std::vector<float> sx, sy, sz;
+        std::vector<std::uint16_t> code;
+
+        void resize(std::size_t count);
+    };
+
+    // Screen space mapping of normalised device coordinates: x and y to pixels, z to z * f1 + f2 + f3 / w,
+    // which like z is linear in screen space
+    struct viewport
+    {
+        int width, height;
+        float f1, f2, f3;
+
+        //Homogeneous division and viewport transformation
+        Eigen::Vector3f to_screen(float x, float y, float z, float w) const
+        {
+            float inv = f3 / w;
+            x /= w;
+            y /= w;
+            z /= w;
+            return Eigen::Vector3f(float(0.5 * width * (x + 1.0)), float(0.5 * height * (y + 1.0)), z * f1 + f2 + inv);
+        }
+    };
+
+    /*
+     * Viewport of a width x height screen whose depth runs from 0 at the near plane of projection to 1 at
+     * its far plane, or with reversed_z from -1 to 0 (see rasterizer::set_reversed_z). The planes are
+     * where the projection maps depth to -1 and 1, as in OpenGL; a far plane at infinity is fine. For
+     * perspective projections depth follows from w alone, so no precision is lost to z / w; projections
+     * that are not a perspective along z keep their normalised depth, -1..1 mapped to 0..1.
+     * */
+    viewport make_viewport(int width, int height, const Eigen::Matrix4f& projection, bool reversed_z);
+
+    /*
+     * Clip space is expected with w > 0 in front of the camera. Points are inside the view volume for
+     * -w <= x, y <= w, z between -w and w if depth clipping is enabled, and w >= w_min, which keeps
+     * points at or behind the eye out of the division. Triangles are only clipped against the x and y
+     * planes when they leave the guard band, guard times wider than the view volume; inside it the
+     * rasterizer's bounding box clamping is cheaper and exact.
+     * */
+    struct clip_volume
+    {
+        float guard = 4.0f;
+        float w_min = 1e-5f;
+        bool depth = false;
+
+        // Outcode bits 0-6 flag the planes x >= -w, x <= w, y >= -w, y <= w, z >= -w, z <= w and
+        // w >= w_min a point lies outside of; bits 8-14 the same with the guard band for x and y.
+        static constexpr std::uint16_t outside_mask = 0x007f;
+        static constexpr std::uint16_t guard_mask = 0x7f00;
+
+        std::uint16_t outcode(float x, float y, float z, float w) const;
+
+        // Signed distance to plane p (0-6) of the guard band volume, negative outside
+        float distance(int p, const float* v) const;
+    };
+
+    // Fills out with count vertices. Every simd_level gives the same results.
+    void transform_vertices(const Eigen::Vector3f* positions, std::size_t count, const Eigen::Matrix4f& mvp,
+                            const viewport& vp, const clip_volume& clip, simd_level level, vertex_cache& out);
+
+    // Fills in the outcodes and screen positions of vertices whose clip space position is already in out,
+    // negating that position first if flip is set
+    void project_vertices(const viewport& vp, const clip_volume& clip, bool flip, vertex_cache& out);
+
+    // Vertex of a clipped polygon: clip space position and barycentric weights in the original triangle
+    struct clip_vertex
+    {
+        float pos[4];
+        float weight[3];
+    };
+
+    /*
+     * Sutherland-Hodgman clipping of a triangle against the guard band planes flagged in planes (a
+     * guard_mask outcode). Writes the resulting convex polygon, up to 10 vertices, to out and returns
+     * its vertex count, 0 if nothing is left. Intersections are always computed from the inside end of
+     * an edge, so triangles sharing an edge get the same new vertices and no cracks.
+     * */
+    int clip_triangle(const clip_vertex in[3], std::uint16_t planes, const clip_volume& clip, clip_vertex out[10]);
+}